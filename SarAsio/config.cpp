@@ -16,8 +16,10 @@
 
 #include "stdafx.h"
 #include "config.h"
+#include "sar.h"
 #include "utility.h"
 
+#include <cwctype>
 #include <fstream>
 
 namespace Sar {
@@ -30,6 +32,10 @@ bool EndpointConfig::load(picojson::object& obj)
     auto poChannelCount = obj.find("channelCount");
     auto poAttachPhysical = obj.find("attachPhysical");
     auto poPhysicalChannelBase = obj.find("physicalChannelBase");
+    auto poChannelMap = obj.find("channelMap");
+    auto poChannelMix = obj.find("channelMix");
+    auto poDelayFrames = obj.find("delayFrames");
+    auto poSampleRate = obj.find("sampleRate");
 
     if (poId == obj.end() || poDescription == obj.end() ||
         poType == obj.end() || poChannelCount == obj.end()) {
@@ -65,6 +71,36 @@ bool EndpointConfig::load(picojson::object& obj)
         physicalChannelBase = (int)poPhysicalChannelBase->second.get<double>();
     }
 
+    if (poChannelMap != obj.end() &&
+        poChannelMap->second.is<picojson::array>()) {
+
+        for (auto& item : poChannelMap->second.get<picojson::array>()) {
+            auto channel = item.is<double>() ? (int)item.get<double>() : -1;
+
+            channelMap.push_back(
+                channel >= 0 && channel < channelCount ? channel : -1);
+        }
+    }
+
+    if (poChannelMix != obj.end() && poChannelMix->second.is<std::string>()) {
+        standardMix = poChannelMix->second.get<std::string>() == "standard";
+    }
+
+    if (poDelayFrames != obj.end() && poDelayFrames->second.is<double>()) {
+        delayFrames = max(0, min(SAR_MAX_DELAY_FRAMES,
+            (int)poDelayFrames->second.get<double>()));
+    }
+
+    if (poSampleRate != obj.end() && poSampleRate->second.is<double>()) {
+        sampleRate = (int)poSampleRate->second.get<double>();
+
+        if (sampleRate < SAR_MIN_SAMPLE_RATE ||
+            sampleRate > SAR_MAX_SAMPLE_RATE) {
+
+            sampleRate = 0;
+        }
+    }
+
     return true;
 }
 
@@ -86,6 +122,76 @@ picojson::object EndpointConfig::save()
             picojson::value(double(physicalChannelBase))));
     }
 
+    if (channelMap.size()) {
+        picojson::array arr;
+
+        for (auto channel : channelMap) {
+            arr.emplace_back(picojson::value(double(channel)));
+        }
+
+        result.insert(std::make_pair("channelMap", picojson::value(arr)));
+    }
+
+    if (standardMix) {
+        result.insert(std::make_pair("channelMix", picojson::value("standard")));
+    }
+
+    if (delayFrames) {
+        result.insert(std::make_pair("delayFrames",
+            picojson::value(double(delayFrames))));
+    }
+
+    if (sampleRate) {
+        result.insert(std::make_pair("sampleRate",
+            picojson::value(double(sampleRate))));
+    }
+
+    return result;
+}
+
+bool MixConfig::load(picojson::object& obj)
+{
+    auto poFrom = obj.find("from");
+    auto poFromChannel = obj.find("fromChannel");
+    auto poTo = obj.find("to");
+    auto poToChannel = obj.find("toChannel");
+    auto poGain = obj.find("gain");
+
+    if (poFrom == obj.end() || poFromChannel == obj.end() ||
+        poTo == obj.end() || poToChannel == obj.end()) {
+        return false;
+    }
+
+    if (!poFrom->second.is<std::string>() ||
+        !poFromChannel->second.is<double>() ||
+        !poTo->second.is<std::string>() ||
+        !poToChannel->second.is<double>()) {
+        return false;
+    }
+
+    from = poFrom->second.get<std::string>();
+    fromChannel = (int)poFromChannel->second.get<double>();
+    to = poTo->second.get<std::string>();
+    toChannel = (int)poToChannel->second.get<double>();
+
+    if (poGain != obj.end() && poGain->second.is<double>()) {
+        gain = (float)poGain->second.get<double>();
+    }
+
+    return true;
+}
+
+picojson::object MixConfig::save()
+{
+    picojson::object result;
+
+    result.insert(std::make_pair("from", picojson::value(from)));
+    result.insert(std::make_pair("fromChannel",
+        picojson::value(double(fromChannel))));
+    result.insert(std::make_pair("to", picojson::value(to)));
+    result.insert(std::make_pair("toChannel",
+        picojson::value(double(toChannel))));
+    result.insert(std::make_pair("gain", picojson::value(double(gain))));
     return result;
 }
 
@@ -156,19 +262,6 @@ picojson::object DefaultEndpointConfig::save()
     return result;
 }
 
-static std::wstring constantRegex(const std::wstring& path)
-{
-    static const std::wregex escape(L"[.^$|()\\[\\]{}*+?\\\\]");
-    std::wostringstream os;
-
-    os << "^"
-       << std::regex_replace(path, escape, L"\\\\&",
-              std::regex_constants::match_default |
-              std::regex_constants::format_sed)
-       << "$";
-    return os.str();
-}
-
 bool ApplicationConfig::load(picojson::object& obj)
 {
     auto poDescription = obj.find("description");
@@ -208,17 +301,7 @@ bool ApplicationConfig::load(picojson::object& obj)
         regexMatch = poRegexMatch->second.get<bool>();
     }
 
-    try {
-        path = UTF8ToWide(poPath->second.get<std::string>());
-
-        // TODO: UTF-8 support on Windows is very sad. This might need ICU or
-        // PCRE.
-        pattern = std::wregex(regexMatch ? path : constantRegex(path),
-            std::regex_constants::ECMAScript | std::regex_constants::icase);
-    } catch (std::exception&) {
-        // nom nom
-    }
-
+    path = UTF8ToWide(poPath->second.get<std::string>());
     return true;
 }
 
@@ -246,13 +329,79 @@ picojson::object ApplicationConfig::save()
     return result;
 }
 
+static std::wstring foldCase(const std::wstring& str)
+{
+    std::wstring result(str);
+
+    for (auto& c : result) {
+        c = std::towlower(c);
+    }
+
+    return result;
+}
+
+void ApplicationMatcher::build(
+    const std::vector<ApplicationConfig>& applications)
+{
+    _literals.clear();
+    _regexes.clear();
+
+    for (size_t i = 0; i < applications.size(); ++i) {
+        auto& application = applications[i];
+
+        if (!application.regexMatch) {
+            // emplace keeps the earliest rule for duplicate paths.
+            _literals.emplace(foldCase(application.path), i);
+            continue;
+        }
+
+        try {
+            // TODO: UTF-8 support on Windows is very sad. This might need ICU
+            // or PCRE.
+            _regexes.push_back({ i, std::wregex(application.path,
+                std::regex_constants::ECMAScript |
+                std::regex_constants::icase |
+                std::regex_constants::optimize) });
+        } catch (std::exception&) {
+            LOG(ERROR) << "Ignoring invalid application pattern: "
+                << TCHARToUTF8(application.path.c_str());
+        }
+    }
+}
+
+int ApplicationMatcher::match(const std::wstring& path) const
+{
+    size_t limit = SIZE_MAX;
+    auto literal = _literals.find(foldCase(path));
+
+    if (literal != _literals.end()) {
+        limit = literal->second;
+    }
+
+    for (auto& rule : _regexes) {
+        if (rule.index >= limit) {
+            break;
+        }
+
+        if (std::regex_search(path, rule.pattern)) {
+            return (int)rule.index;
+        }
+    }
+
+    return limit == SIZE_MAX ? -1 : (int)limit;
+}
+
 void DriverConfig::load(picojson::object& obj)
 {
     auto poDriverClsid = obj.find("driverClsid");
     auto poEndpoints = obj.find("endpoints");
     auto poApplications = obj.find("applications");
+    auto poMixes = obj.find("mixes");
     auto poWaveRtMinimumFrames = obj.find("waveRtMinimumFrames");
     auto poEnableApplicationRouting = obj.find("enableApplicationRouting");
+    auto poPersistentEndpoints = obj.find("persistentEndpoints");
+    auto poDither = obj.find("dither");
+    auto poSoftwareClock = obj.find("softwareClock");
 
     if (poDriverClsid != obj.end() &&
         poDriverClsid->second.is<std::string>()) {
@@ -289,6 +438,20 @@ void DriverConfig::load(picojson::object& obj)
         }
     }
 
+    if (poMixes != obj.end() && poMixes->second.is<picojson::array>()) {
+        for (auto& item : poMixes->second.get<picojson::array>()) {
+            if (!item.is<picojson::object>()) {
+                continue;
+            }
+
+            MixConfig mix;
+
+            if (mix.load(item.get<picojson::object>())) {
+                mixes.emplace_back(mix);
+            }
+        }
+    }
+
     if (poWaveRtMinimumFrames != obj.end() &&
         poWaveRtMinimumFrames->second.is<double>()) {
 
@@ -301,6 +464,37 @@ void DriverConfig::load(picojson::object& obj)
         enableApplicationRouting =
             poEnableApplicationRouting->second.get<bool>();
     }
+
+    if (poPersistentEndpoints != obj.end() &&
+        poPersistentEndpoints->second.is<bool>()) {
+
+        persistentEndpoints = poPersistentEndpoints->second.get<bool>();
+    }
+
+    if (poDither != obj.end() && poDither->second.is<bool>()) {
+        dither = poDither->second.get<bool>();
+    }
+
+    if (poSoftwareClock != obj.end() &&
+        poSoftwareClock->second.is<picojson::object>()) {
+
+        auto& clock = poSoftwareClock->second.get<picojson::object>();
+        auto poSampleRate = clock.find("sampleRate");
+        auto poBufferSize = clock.find("bufferSize");
+
+        if (poSampleRate != clock.end() && poSampleRate->second.is<double>()) {
+            softwareClockSampleRate = max(SAR_MIN_SAMPLE_RATE,
+                min(SAR_MAX_SAMPLE_RATE,
+                    (int)poSampleRate->second.get<double>()));
+        }
+
+        if (poBufferSize != clock.end() && poBufferSize->second.is<double>()) {
+            softwareClockBufferSize = max(
+                SAR_SOFTWARE_CLOCK_MIN_BUFFER_SIZE,
+                min(SAR_SOFTWARE_CLOCK_MAX_BUFFER_SIZE,
+                    (int)poBufferSize->second.get<double>()));
+        }
+    }
 }
 
 picojson::object DriverConfig::save()
@@ -316,6 +510,28 @@ picojson::object DriverConfig::save()
             picojson::value((double)waveRtMinimumFrames)));
     }
 
+    if (persistentEndpoints) {
+        result.insert(std::make_pair("persistentEndpoints",
+            picojson::value(persistentEndpoints)));
+    }
+
+    if (dither) {
+        result.insert(std::make_pair("dither", picojson::value(dither)));
+    }
+
+    if (softwareClockSampleRate != SAR_SOFTWARE_CLOCK_DEFAULT_SAMPLE_RATE ||
+        softwareClockBufferSize != SAR_SOFTWARE_CLOCK_DEFAULT_BUFFER_SIZE) {
+
+        picojson::object softwareClock;
+
+        softwareClock.insert(std::make_pair("sampleRate",
+            picojson::value((double)softwareClockSampleRate)));
+        softwareClock.insert(std::make_pair("bufferSize",
+            picojson::value((double)softwareClockBufferSize)));
+        result.insert(std::make_pair("softwareClock",
+            picojson::value(softwareClock)));
+    }
+
     if (endpoints.size()) {
         picojson::array arr;
 
@@ -336,26 +552,305 @@ picojson::object DriverConfig::save()
         result.insert(std::make_pair("applications", picojson::value(arr)));
     }
 
+    if (mixes.size()) {
+        picojson::array arr;
+
+        for (auto& mix : mixes) {
+            arr.emplace_back(mix.save());
+        }
+
+        result.insert(std::make_pair("mixes", picojson::value(arr)));
+    }
+
     return result;
 }
 
+// The binary snapshot that sits next to a JSON config. It is a straight
+// serialization of DriverConfig, so processes that only need to read the
+// config (every audio application, through the MMDeviceEnumerator wrapper)
+// can map it instead of running the JSON parser. The header records the size
+// and write time of the JSON it was made from, and the snapshot is ignored
+// if those no longer match.
+#define SAR_CONFIG_SNAPSHOT_MAGIC 0x43524153 // "SARC"
+#define SAR_CONFIG_SNAPSHOT_VERSION 8
+
+struct ConfigSnapshotHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t reserved;
+    uint64_t sourceSize;
+    uint64_t sourceWriteTime;
+};
+
+static std::wstring snapshotPathFor(const std::wstring& path)
+{
+    static const std::wstring jsonExtension(L".json");
+
+    if (path.size() > jsonExtension.size() &&
+        !path.compare(path.size() - jsonExtension.size(),
+            jsonExtension.size(), jsonExtension)) {
+
+        return path.substr(0, path.size() - jsonExtension.size()) + L".bin";
+    }
+
+    return path + L".bin";
+}
+
+static bool sourceFileStamp(
+    const std::wstring& path, uint64_t& size, uint64_t& writeTime)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+
+    if (!GetFileAttributesEx(path.c_str(), GetFileExInfoStandard, &data)) {
+        return false;
+    }
+
+    size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    writeTime = ((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) |
+        data.ftLastWriteTime.dwLowDateTime;
+    return true;
+}
+
+struct SnapshotWriter
+{
+    std::string data;
+
+    void write(uint32_t value)
+    {
+        data.append((const char *)&value, sizeof(value));
+    }
+
+    void write(float value)
+    {
+        uint32_t raw;
+
+        memcpy(&raw, &value, sizeof(raw));
+        write(raw);
+    }
+
+    void write(const std::string& str)
+    {
+        write((uint32_t)str.size());
+        data.append(str);
+    }
+
+    void write(const std::wstring& str)
+    {
+        write((uint32_t)str.size());
+        data.append(
+            (const char *)str.data(), str.size() * sizeof(wchar_t));
+    }
+};
+
+struct SnapshotReader
+{
+    const char *pos;
+    const char *end;
+
+    bool read(uint32_t& value)
+    {
+        if ((size_t)(end - pos) < sizeof(value)) {
+            return false;
+        }
+
+        memcpy(&value, pos, sizeof(value));
+        pos += sizeof(value);
+        return true;
+    }
+
+    bool read(int& value)
+    {
+        uint32_t raw;
+
+        if (!read(raw)) {
+            return false;
+        }
+
+        value = (int)raw;
+        return true;
+    }
+
+    bool read(float& value)
+    {
+        uint32_t raw;
+
+        if (!read(raw)) {
+            return false;
+        }
+
+        memcpy(&value, &raw, sizeof(value));
+        return true;
+    }
+
+    bool read(bool& value)
+    {
+        uint32_t raw;
+
+        if (!read(raw)) {
+            return false;
+        }
+
+        value = raw != 0;
+        return true;
+    }
+
+    bool read(std::string& str)
+    {
+        uint32_t length;
+
+        if (!read(length) || (size_t)(end - pos) < length) {
+            return false;
+        }
+
+        str.assign(pos, length);
+        pos += length;
+        return true;
+    }
+
+    bool read(std::wstring& str)
+    {
+        uint32_t length;
+
+        if (!read(length) ||
+            (size_t)(end - pos) / sizeof(wchar_t) < length) {
+
+            return false;
+        }
+
+        str.resize(length);
+        memcpy(&str[0], pos, length * sizeof(wchar_t));
+        pos += length * sizeof(wchar_t);
+        return true;
+    }
+};
+
 bool DriverConfig::writeFile(const std::wstring& path)
 {
-    std::ofstream fp(path);
+    {
+        std::ofstream fp(path);
 
-    if (fp.bad()) {
+        if (fp.bad()) {
+            return false;
+        }
+
+        picojson::value(save()).serialize(
+            std::ostream_iterator<char>(fp), true);
+    }
+
+    if (!writeSnapshot(snapshotPathFor(path), path)) {
+        LOG(ERROR) << "Failed to write config snapshot.";
+    }
+
+    return true;
+}
+
+bool DriverConfig::writeSnapshot(
+    const std::wstring& path, const std::wstring& sourcePath)
+{
+    ConfigSnapshotHeader header = {};
+    SnapshotWriter writer;
+    std::wstring tempPath = path + L".tmp";
+
+    if (!sourceFileStamp(
+        sourcePath, header.sourceSize, header.sourceWriteTime)) {
+
+        return false;
+    }
+
+    writer.write(driverClsid);
+    writer.write((uint32_t)waveRtMinimumFrames);
+    writer.write((uint32_t)enableApplicationRouting);
+    writer.write((uint32_t)persistentEndpoints);
+    writer.write((uint32_t)dither);
+    writer.write((uint32_t)softwareClockSampleRate);
+    writer.write((uint32_t)softwareClockBufferSize);
+    writer.write((uint32_t)endpoints.size());
+
+    for (auto& endpoint : endpoints) {
+        writer.write(endpoint.id);
+        writer.write(endpoint.description);
+        writer.write((uint32_t)endpoint.type);
+        writer.write((uint32_t)endpoint.channelCount);
+        writer.write((uint32_t)endpoint.attachPhysical);
+        writer.write((uint32_t)endpoint.physicalChannelBase);
+        writer.write((uint32_t)endpoint.channelMap.size());
+
+        for (auto channel : endpoint.channelMap) {
+            writer.write((uint32_t)channel);
+        }
+
+        writer.write((uint32_t)endpoint.standardMix);
+        writer.write((uint32_t)endpoint.delayFrames);
+        writer.write((uint32_t)endpoint.sampleRate);
+    }
+
+    writer.write((uint32_t)applications.size());
+
+    for (auto& application : applications) {
+        writer.write(application.description);
+        writer.write(application.path);
+        writer.write((uint32_t)application.regexMatch);
+        writer.write((uint32_t)application.defaults.size());
+
+        for (auto& defaultEndpoint : application.defaults) {
+            writer.write((uint32_t)defaultEndpoint.type);
+            writer.write((uint32_t)defaultEndpoint.role);
+            writer.write(defaultEndpoint.id);
+        }
+    }
+
+    writer.write((uint32_t)mixes.size());
+
+    for (auto& mix : mixes) {
+        writer.write(mix.from);
+        writer.write((uint32_t)mix.fromChannel);
+        writer.write(mix.to);
+        writer.write((uint32_t)mix.toChannel);
+        writer.write(mix.gain);
+    }
+
+    header.magic = SAR_CONFIG_SNAPSHOT_MAGIC;
+    header.version = SAR_CONFIG_SNAPSHOT_VERSION;
+    header.size = (uint32_t)(sizeof(header) + writer.data.size());
+
+    // Write to the side and rename, so readers never map a partial file.
+    {
+        std::ofstream fp(tempPath, std::ios::binary | std::ios::trunc);
+
+        if (!fp.is_open()) {
+            return false;
+        }
+
+        fp.write((const char *)&header, sizeof(header));
+        fp.write(writer.data.data(), writer.data.size());
+
+        if (!fp.good()) {
+            return false;
+        }
+    }
+
+    if (!MoveFileEx(tempPath.c_str(), path.c_str(),
+        MOVEFILE_REPLACE_EXISTING)) {
+
+        DeleteFile(tempPath.c_str());
         return false;
     }
 
-    picojson::value(save()).serialize(std::ostream_iterator<char>(fp), true);
     return true;
 }
 
 DriverConfig DriverConfig::fromFile(const std::wstring& path)
 {
+    DriverConfig result;
+
+    if (fromSnapshot(snapshotPathFor(path), path, result)) {
+        return result;
+    }
+
     std::ifstream fp(path);
     picojson::value json;
-    DriverConfig result;
 
     if (fp.bad()) {
         return result;
@@ -370,6 +865,182 @@ DriverConfig DriverConfig::fromFile(const std::wstring& path)
     return result;
 }
 
+static bool readSnapshot(SnapshotReader& reader, DriverConfig& config)
+{
+    uint32_t count;
+
+    if (!reader.read(config.driverClsid) ||
+        !reader.read(config.waveRtMinimumFrames) ||
+        !reader.read(config.enableApplicationRouting) ||
+        !reader.read(config.persistentEndpoints) ||
+        !reader.read(config.dither) ||
+        !reader.read(config.softwareClockSampleRate) ||
+        !reader.read(config.softwareClockBufferSize) ||
+        !reader.read(count)) {
+
+        return false;
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        EndpointConfig endpoint;
+        uint32_t type, mapCount;
+
+        if (!reader.read(endpoint.id) ||
+            !reader.read(endpoint.description) ||
+            !reader.read(type) ||
+            !reader.read(endpoint.channelCount) ||
+            !reader.read(endpoint.attachPhysical) ||
+            !reader.read(endpoint.physicalChannelBase) ||
+            !reader.read(mapCount)) {
+
+            return false;
+        }
+
+        for (uint32_t j = 0; j < mapCount; ++j) {
+            int channel;
+
+            if (!reader.read(channel)) {
+                return false;
+            }
+
+            endpoint.channelMap.push_back(channel);
+        }
+
+        if (!reader.read(endpoint.standardMix) ||
+            !reader.read(endpoint.delayFrames) ||
+            !reader.read(endpoint.sampleRate)) {
+
+            return false;
+        }
+
+        endpoint.type = (EndpointType)type;
+        config.endpoints.emplace_back(endpoint);
+    }
+
+    if (!reader.read(count)) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        ApplicationConfig application;
+        uint32_t defaultCount;
+
+        if (!reader.read(application.description) ||
+            !reader.read(application.path) ||
+            !reader.read(application.regexMatch) ||
+            !reader.read(defaultCount)) {
+
+            return false;
+        }
+
+        for (uint32_t j = 0; j < defaultCount; ++j) {
+            DefaultEndpointConfig defaultEndpoint;
+            uint32_t type, role;
+
+            if (!reader.read(type) || !reader.read(role) ||
+                !reader.read(defaultEndpoint.id)) {
+
+                return false;
+            }
+
+            defaultEndpoint.type = (EDataFlow)type;
+            defaultEndpoint.role = (ERole)role;
+            application.defaults.emplace_back(defaultEndpoint);
+        }
+
+        config.applications.emplace_back(application);
+    }
+
+    if (!reader.read(count)) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        MixConfig mix;
+
+        if (!reader.read(mix.from) || !reader.read(mix.fromChannel) ||
+            !reader.read(mix.to) || !reader.read(mix.toChannel) ||
+            !reader.read(mix.gain)) {
+
+            return false;
+        }
+
+        config.mixes.emplace_back(mix);
+    }
+
+    return true;
+}
+
+bool DriverConfig::fromSnapshot(
+    const std::wstring& path, const std::wstring& sourcePath,
+    DriverConfig& result)
+{
+    LARGE_INTEGER fileSize;
+    ConfigSnapshotHeader header;
+    SnapshotReader reader;
+    uint64_t sourceSize, sourceWriteTime;
+    DriverConfig config;
+    bool ok = false;
+
+    if (!sourceFileStamp(sourcePath, sourceSize, sourceWriteTime)) {
+        return false;
+    }
+
+    HANDLE file = CreateFile(path.c_str(), GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    if (!GetFileSizeEx(file, &fileSize) ||
+        fileSize.QuadPart < (LONGLONG)sizeof(header) ||
+        fileSize.QuadPart > MAXDWORD) {
+
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMapping(
+        file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+    CloseHandle(file);
+
+    if (!mapping) {
+        return false;
+    }
+
+    auto view = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+    CloseHandle(mapping);
+
+    if (!view) {
+        return false;
+    }
+
+    memcpy(&header, view, sizeof(header));
+
+    if (header.magic == SAR_CONFIG_SNAPSHOT_MAGIC &&
+        header.version == SAR_CONFIG_SNAPSHOT_VERSION &&
+        (LONGLONG)header.size == fileSize.QuadPart &&
+        header.sourceSize == sourceSize &&
+        header.sourceWriteTime == sourceWriteTime) {
+
+        reader.pos = view + sizeof(header);
+        reader.end = view + header.size;
+        ok = readSnapshot(reader, config);
+    }
+
+    UnmapViewOfFile(view);
+
+    if (ok) {
+        result = std::move(config);
+    }
+
+    return ok;
+}
+
 EndpointConfig *DriverConfig::findEndpoint(const std::string& id)
 {
     for (auto& ep : endpoints) {
@@ -381,4 +1052,59 @@ EndpointConfig *DriverConfig::findEndpoint(const std::string& id)
     return nullptr;
 }
 
+const EndpointConfig *DriverConfig::findEndpoint(const std::string& id) const
+{
+    for (auto& ep : endpoints) {
+        if (ep.id == id) {
+            return &ep;
+        }
+    }
+
+    return nullptr;
+}
+
+ConfigDiff DiffConfig(
+    const DriverConfig& oldConfig, const DriverConfig& newConfig)
+{
+    ConfigDiff diff;
+
+    if (oldConfig.driverClsid != newConfig.driverClsid ||
+        oldConfig.waveRtMinimumFrames != newConfig.waveRtMinimumFrames ||
+        oldConfig.softwareClockSampleRate !=
+            newConfig.softwareClockSampleRate ||
+        oldConfig.softwareClockBufferSize !=
+            newConfig.softwareClockBufferSize) {
+
+        diff.needsReset = true;
+    }
+
+    for (auto& oldEndpoint : oldConfig.endpoints) {
+        auto newEndpoint = newConfig.findEndpoint(oldEndpoint.id);
+
+        if (!newEndpoint) {
+            diff.removedEndpoints.push_back(oldEndpoint.id);
+            diff.channelsChanged |= !oldEndpoint.attachPhysical;
+        } else if (newEndpoint->type != oldEndpoint.type ||
+            newEndpoint->channelCount != oldEndpoint.channelCount ||
+            newEndpoint->description != oldEndpoint.description ||
+            newEndpoint->attachPhysical != oldEndpoint.attachPhysical ||
+            newEndpoint->physicalChannelBase !=
+                oldEndpoint.physicalChannelBase ||
+            newEndpoint->sampleRate != oldEndpoint.sampleRate) {
+
+            diff.needsReset = true;
+        }
+    }
+
+    for (auto& newEndpoint : newConfig.endpoints) {
+        if (!oldConfig.findEndpoint(newEndpoint.id)) {
+            diff.addedEndpoints.push_back(newEndpoint.id);
+            diff.channelsChanged |= !newEndpoint.attachPhysical;
+        }
+    }
+
+    diff.channelsChanged |= diff.needsReset;
+    return diff;
+}
+
 } // namespace Sar
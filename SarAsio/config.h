@@ -21,6 +21,15 @@
 
 namespace Sar {
 
+// Longest per-endpoint delay, one second at the highest sample rate.
+#define SAR_MAX_DELAY_FRAMES 192000
+
+// Software clock period defaults and the buffer sizes it accepts.
+#define SAR_SOFTWARE_CLOCK_DEFAULT_SAMPLE_RATE 48000
+#define SAR_SOFTWARE_CLOCK_DEFAULT_BUFFER_SIZE 256
+#define SAR_SOFTWARE_CLOCK_MIN_BUFFER_SIZE 16
+#define SAR_SOFTWARE_CLOCK_MAX_BUFFER_SIZE 8192
+
 enum class EndpointType
 {
     Playback,
@@ -35,6 +44,24 @@ struct EndpointConfig
     int channelCount = 2;
     bool attachPhysical = false;
     int physicalChannelBase = 0;
+    std::vector<int> channelMap; // stream channel per ASIO channel, or -1
+    bool standardMix = false; // mono/stereo up and downmix when unmapped
+    int delayFrames = 0;
+    int sampleRate = 0; // converted to and from the ASIO rate, 0 for none
+
+    bool load(picojson::object& obj);
+    picojson::object save();
+};
+
+// One entry of the sparse mix matrix: a playback endpoint channel summed
+// into a recording endpoint channel inside the driver, in the same period.
+struct MixConfig
+{
+    std::string from;
+    int fromChannel = 0;
+    std::string to;
+    int toChannel = 0;
+    float gain = 1.0f;
 
     bool load(picojson::object& obj);
     picojson::object save();
@@ -55,27 +82,77 @@ struct ApplicationConfig
     std::wstring description;
     std::wstring path;
     bool regexMatch = false;
-    std::wregex pattern;
     std::vector<DefaultEndpointConfig> defaults;
 
     bool load(picojson::object& obj);
     picojson::object save();
 };
 
+// Finds the first application rule matching a process image path. Plain path
+// rules are looked up case-insensitively in a hash map, so only the regex
+// rules ordered ahead of a literal hit ever need to run.
+struct ApplicationMatcher
+{
+    void build(const std::vector<ApplicationConfig>& applications);
+    int match(const std::wstring& path) const; // rule index, or -1
+
+private:
+    struct RegexRule
+    {
+        size_t index;
+        std::wregex pattern;
+    };
+
+    std::unordered_map<std::wstring, size_t> _literals;
+    std::vector<RegexRule> _regexes;
+};
+
 struct DriverConfig
 {
     std::string driverClsid;
     std::vector<EndpointConfig> endpoints;
     std::vector<ApplicationConfig> applications;
+    std::vector<MixConfig> mixes;
     int waveRtMinimumFrames = 0;
     bool enableApplicationRouting = false;
+    bool persistentEndpoints = false; // keep endpoints across ASIO stop/start
+    bool dither = false; // dither float mixes narrowed to 16/24 bit
+
+    // Period of the built-in software clock, used in place of a hardware
+    // interface.
+    int softwareClockSampleRate = SAR_SOFTWARE_CLOCK_DEFAULT_SAMPLE_RATE;
+    int softwareClockBufferSize = SAR_SOFTWARE_CLOCK_DEFAULT_BUFFER_SIZE;
 
     void load(picojson::object& obj);
     picojson::object save();
     bool writeFile(const std::wstring& path);
+    bool writeSnapshot(
+        const std::wstring& path, const std::wstring& sourcePath);
     static DriverConfig fromFile(const std::wstring& path);
+    static bool fromSnapshot(
+        const std::wstring& path, const std::wstring& sourcePath,
+        DriverConfig& result);
     EndpointConfig *findEndpoint(const std::string& id);
+    const EndpointConfig *findEndpoint(const std::string& id) const;
 };
 
+// Changes needed to move a running client from one config to another. The
+// client can't follow a change to channels the host already has: an endpoint
+// kept across the change with a different type, channel count, name or
+// physical attachment, or a change to the interface or buffer layout. Those
+// set needsReset. Added and removed endpoints are applied to the running
+// client right away, but when they own ASIO channels the host still has to
+// reset to pick up the new channel list, which channelsChanged asks for.
+struct ConfigDiff
+{
+    bool needsReset = false;
+    bool channelsChanged = false;
+    std::vector<std::string> addedEndpoints;
+    std::vector<std::string> removedEndpoints;
+};
+
+ConfigDiff DiffConfig(
+    const DriverConfig& oldConfig, const DriverConfig& newConfig);
+
 } // namespace Sar
 #endif // _SAR_ASIO_CONFIG_H
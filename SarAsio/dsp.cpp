@@ -0,0 +1,483 @@
+// SynchronousAudioRouter
+// Copyright (C) 2015 Mackenzie Straight
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SynchronousAudioRouter.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "stdafx.h"
+#include <emmintrin.h>
+#include "dsp.h"
+
+namespace Sar {
+
+static const float kScale16 = 1.0f / 32768.0f;
+static const float kScale24 = 1.0f / 8388608.0f;
+static const float kScale32 = 1.0f / 2147483648.0f;
+
+static inline int32_t load24(const uint8_t *p)
+{
+    return (int32_t)((p[0] << 8) | (p[1] << 16) | ((uint32_t)p[2] << 24)) >> 8;
+}
+
+static inline void store24(uint8_t *p, int32_t value)
+{
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+    p[2] = (uint8_t)(value >> 16);
+}
+
+static inline int64_t clamp64(int64_t value, int64_t lo, int64_t hi)
+{
+    return value < lo ? lo : value > hi ? hi : value;
+}
+
+// Rounds a value in LSB units to a sample in [lo, hi]. With dither, adds
+// triangular noise of +-1 LSB and feeds back the previous quantization
+// error, which tilts the noise floor up towards frequencies where it is less
+// audible. The fed back error is bounded so clipping can't make the loop
+// run away.
+static inline int64_t quantize(
+    double value, int64_t lo, int64_t hi, DitherState *dither)
+{
+    if (!dither) {
+        return clamp64(llrint(value), lo, hi);
+    }
+
+    double shaped = value - dither->error;
+    auto result = clamp64(
+        llrint(shaped + dither->next() + dither->next()), lo, hi);
+    double error = result - shaped;
+
+    dither->error = (float)(error < -1.0 ? -1.0 : error > 1.0 ? 1.0 : error);
+    return result;
+}
+
+void DecodeChannel(
+    float *dst, const void *src, size_t frames, size_t stride,
+    int sampleSize)
+{
+    auto p = (const uint8_t *)src;
+
+    switch (sampleSize) {
+    case 2:
+        for (size_t i = 0; i < frames; ++i, p += stride) {
+            dst[i] = *(const int16_t *)p * kScale16;
+        }
+
+        break;
+
+    case 3:
+        for (size_t i = 0; i < frames; ++i, p += stride) {
+            dst[i] = load24(p) * kScale24;
+        }
+
+        break;
+
+    case 4:
+        for (size_t i = 0; i < frames; ++i, p += stride) {
+            dst[i] = *(const int32_t *)p * kScale32;
+        }
+
+        break;
+
+    default:
+        memset(dst, 0, frames * sizeof(float));
+        break;
+    }
+}
+
+void CopyChannel(
+    void *dst, size_t dstStride, const void *src, size_t srcStride,
+    size_t frames, int sampleSize)
+{
+    auto d = (uint8_t *)dst;
+    auto s = (const uint8_t *)src;
+
+    switch (sampleSize) {
+    case 2:
+        for (size_t i = 0; i < frames; ++i, d += dstStride, s += srcStride) {
+            *(int16_t *)d = *(const int16_t *)s;
+        }
+
+        break;
+
+    case 4:
+        for (size_t i = 0; i < frames; ++i, d += dstStride, s += srcStride) {
+            *(int32_t *)d = *(const int32_t *)s;
+        }
+
+        break;
+
+    default:
+        for (size_t i = 0; i < frames; ++i, d += dstStride, s += srcStride) {
+            memcpy(d, s, sampleSize);
+        }
+
+        break;
+    }
+}
+
+void EncodeChannel(
+    void *dst, const float *src, size_t frames, size_t stride,
+    int sampleSize, DitherState *dither)
+{
+    auto p = (uint8_t *)dst;
+
+    switch (sampleSize) {
+    case 2:
+        for (size_t i = 0; i < frames; ++i, p += stride) {
+            *(int16_t *)p = (int16_t)quantize(
+                src[i] * 32768.0, INT16_MIN, INT16_MAX, dither);
+        }
+
+        break;
+
+    case 3:
+        for (size_t i = 0; i < frames; ++i, p += stride) {
+            store24(p, (int32_t)quantize(
+                src[i] * 8388608.0, -0x800000, 0x7FFFFF, dither));
+        }
+
+        break;
+
+    case 4:
+        for (size_t i = 0; i < frames; ++i, p += stride) {
+            *(int32_t *)p = (int32_t)quantize(
+                src[i] * 2147483648.0, INT32_MIN, INT32_MAX, nullptr);
+        }
+
+        break;
+    }
+}
+
+void AccumulateChannel(
+    void *dst, const float *src, size_t frames, size_t stride,
+    int sampleSize, DitherState *dither)
+{
+    auto p = (uint8_t *)dst;
+
+    // Sums are formed in double so full scale 32-bit samples survive the
+    // round trip exactly.
+    switch (sampleSize) {
+    case 2:
+        for (size_t i = 0; i < frames; ++i, p += stride) {
+            auto sample = (int16_t *)p;
+
+            *sample = (int16_t)quantize(*sample + src[i] * 32768.0,
+                INT16_MIN, INT16_MAX, dither);
+        }
+
+        break;
+
+    case 3:
+        for (size_t i = 0; i < frames; ++i, p += stride) {
+            store24(p, (int32_t)quantize(load24(p) + src[i] * 8388608.0,
+                -0x800000, 0x7FFFFF, dither));
+        }
+
+        break;
+
+    case 4:
+        for (size_t i = 0; i < frames; ++i, p += stride) {
+            auto sample = (int32_t *)p;
+
+            *sample = (int32_t)quantize(*sample + src[i] * 2147483648.0,
+                INT32_MIN, INT32_MAX, nullptr);
+        }
+
+        break;
+    }
+}
+
+void MultiplyAccumulate(
+    float *dst, const float *src, float gain, size_t frames)
+{
+    auto g = _mm_set1_ps(gain);
+    size_t i = 0;
+
+    for (; i + 8 <= frames; i += 8) {
+        auto a = _mm_add_ps(_mm_loadu_ps(dst + i),
+            _mm_mul_ps(_mm_loadu_ps(src + i), g));
+        auto b = _mm_add_ps(_mm_loadu_ps(dst + i + 4),
+            _mm_mul_ps(_mm_loadu_ps(src + i + 4), g));
+
+        _mm_storeu_ps(dst + i, a);
+        _mm_storeu_ps(dst + i + 4, b);
+    }
+
+    for (; i < frames; ++i) {
+        dst[i] += gain * src[i];
+    }
+}
+
+// Sum of SAR_RESAMPLER_TAPS products.
+static inline float dotTaps(const float *a, const float *b)
+{
+    auto sum0 = _mm_setzero_ps();
+    auto sum1 = _mm_setzero_ps();
+
+    for (int i = 0; i < SAR_RESAMPLER_TAPS; i += 8) {
+        sum0 = _mm_add_ps(sum0,
+            _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        sum1 = _mm_add_ps(sum1,
+            _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+
+    auto sum = _mm_add_ps(sum0, sum1);
+
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(sum);
+}
+
+void Resampler::init(
+    int inputRate, int outputRate, int channels, size_t maxInputFrames)
+{
+    static const double kPi = 3.14159265358979323846;
+    // Passband edge as a fraction of the lower Nyquist frequency; the rest
+    // is the transition band a filter this short needs.
+    static const double kBandwidth = 0.9;
+    double cutoff = kBandwidth * min(1.0, (double)outputRate / inputRate);
+    double half = SAR_RESAMPLER_TAPS / 2;
+    size_t maxOutputFrames = (size_t)ceil(
+        (double)maxInputFrames * outputRate / inputRate) + 2;
+
+    _step = (double)inputRate / outputRate;
+    _position = half;
+    _inputStride = ((SAR_RESAMPLER_TAPS + maxInputFrames + 3) / 4) * 4;
+    _outputStride = ((maxOutputFrames + 3) / 4) * 4;
+    _table.assign(
+        (SAR_RESAMPLER_PHASES + 1) * SAR_RESAMPLER_TAPS, 0.0f);
+    _inputs.assign(_inputStride * channels, 0.0f);
+    _outputs.assign(_outputStride * channels, 0.0f);
+
+    for (int phase = 0; phase <= SAR_RESAMPLER_PHASES; ++phase) {
+        auto row = &_table[phase * SAR_RESAMPLER_TAPS];
+        double sum = 0;
+
+        for (int tap = 0; tap < SAR_RESAMPLER_TAPS; ++tap) {
+            // Distance from the output frame to this tap's input frame.
+            double t = tap + 1 - half - (double)phase / SAR_RESAMPLER_PHASES;
+            double x = kPi * cutoff * t;
+            double sinc = x == 0 ? 1.0 : sin(x) / x;
+            double window = fabs(t) >= half ? 0.0 :
+                0.42 + 0.5 * cos(kPi * t / half) +
+                0.08 * cos(2 * kPi * t / half);
+            double value = sinc * window;
+
+            row[tap] = (float)value;
+            sum += value;
+        }
+
+        // Unity gain at DC for every phase.
+        for (int tap = 0; tap < SAR_RESAMPLER_TAPS; ++tap) {
+            row[tap] = (float)(row[tap] / sum);
+        }
+    }
+}
+
+size_t Resampler::inputFramesFor(size_t outputFrames) const
+{
+    if (!outputFrames) {
+        return 0;
+    }
+
+    // The last output frame reads up to SAR_RESAMPLER_TAPS / 2 frames past
+    // its position.
+    auto last = (long long)floor(_position + (outputFrames - 1) * _step);
+    auto frames = last + 1 - SAR_RESAMPLER_TAPS / 2;
+
+    return frames > 0 ? (size_t)frames : 0;
+}
+
+size_t Resampler::outputFramesFor(size_t inputFrames) const
+{
+    double limit = (double)(SAR_RESAMPLER_TAPS / 2 + inputFrames);
+
+    if (_position >= limit) {
+        return 0;
+    }
+
+    auto frames = (size_t)ceil((limit - _position) / _step);
+
+    // Settle rounding with the same expression process uses.
+    while (frames && _position + (frames - 1) * _step >= limit) {
+        --frames;
+    }
+
+    while (_position + frames * _step < limit) {
+        ++frames;
+    }
+
+    return frames;
+}
+
+void Resampler::process(int channels, size_t inputFrames, size_t outputFrames)
+{
+    float coefficients[SAR_RESAMPLER_TAPS];
+
+    for (size_t i = 0; i < outputFrames; ++i) {
+        double position = _position + i * _step;
+        auto index = (size_t)position;
+        double phase = (position - index) * SAR_RESAMPLER_PHASES;
+        auto row = (size_t)phase;
+        auto blend = _mm_set1_ps((float)(phase - row));
+        auto lower = &_table[row * SAR_RESAMPLER_TAPS];
+        auto upper = lower + SAR_RESAMPLER_TAPS;
+        auto first = index + 1 - SAR_RESAMPLER_TAPS / 2;
+
+        for (int tap = 0; tap < SAR_RESAMPLER_TAPS; tap += 4) {
+            auto a = _mm_loadu_ps(lower + tap);
+            auto b = _mm_loadu_ps(upper + tap);
+
+            _mm_storeu_ps(coefficients + tap,
+                _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), blend)));
+        }
+
+        for (int channel = 0; channel < channels; ++channel) {
+            _outputs[channel * _outputStride + i] = dotTaps(
+                &_inputs[channel * _inputStride + first], coefficients);
+        }
+    }
+
+    _position += outputFrames * _step - inputFrames;
+
+    // The last SAR_RESAMPLER_TAPS input frames are the next call's history.
+    for (int channel = 0; channel < channels; ++channel) {
+        auto base = &_inputs[channel * _inputStride];
+
+        memmove(base, base + inputFrames, SAR_RESAMPLER_TAPS * sizeof(float));
+    }
+}
+
+// Speaker order of the WAVEFORMATEXTENSIBLE layouts the standard mixes
+// know about: quad is FL FR BL BR, 5.1 is FL FR C LFE BL BR and 7.1 adds
+// SL SR.
+static const float kMinus3dB = 0.70710678f;
+
+void ChannelMix::addTerm(int output, int input, float gain)
+{
+    if (output < 0 || output >= outputs || input < 0 || input >= inputs) {
+        return;
+    }
+
+    auto& count = termCounts[output];
+
+    for (int i = 0; i < count; ++i) {
+        if (terms[output][i].input == input) {
+            terms[output][i].gain += gain;
+            return;
+        }
+    }
+
+    if (count < SAR_MAX_MIX_TERMS) {
+        terms[output][count].input = input;
+        terms[output][count].gain = gain;
+        count++;
+    }
+}
+
+void ChannelMix::build(
+    bool playback, int streamChannels, int asioChannels,
+    const std::vector<int>& channelMap, bool standard)
+{
+    inputs = playback ? streamChannels : asioChannels;
+    outputs = playback ? asioChannels : streamChannels;
+    memset(termCounts, 0, sizeof(termCounts));
+
+    if (!channelMap.empty()) {
+        for (int asio = 0;
+             asio < asioChannels && asio < (int)channelMap.size(); ++asio) {
+
+            if (playback) {
+                addTerm(asio, channelMap[asio], 1.0f);
+            } else {
+                addTerm(channelMap[asio], asio, 1.0f);
+            }
+        }
+    } else if (standard && playback && streamChannels == 1) {
+        // Mono to both fronts.
+        addTerm(0, 0, 1.0f);
+        addTerm(1, 0, 1.0f);
+    } else if (standard && playback && streamChannels == 2 &&
+        (asioChannels == 4 || asioChannels == 6 || asioChannels == 8)) {
+
+        // Stereo copied to the surround pairs, centre and LFE left silent.
+        int rear = asioChannels == 4 ? 2 : 4;
+
+        for (int side = 0; side < 2; ++side) {
+            addTerm(side, side, 1.0f);
+            addTerm(rear + side, side, 1.0f);
+
+            if (asioChannels == 8) {
+                addTerm(6 + side, side, 1.0f);
+            }
+        }
+    } else if (standard && !playback && streamChannels <= 2 &&
+        asioChannels > streamChannels &&
+        (asioChannels == 2 || asioChannels == 4 ||
+         asioChannels == 6 || asioChannels == 8)) {
+
+        // Fold down to stereo, LFE dropped, then to mono if asked for.
+        float scale = streamChannels == 1 ? 0.5f : 1.0f;
+        int rear = asioChannels == 4 ? 2 : 4;
+
+        for (int side = 0; side < 2; ++side) {
+            int output = streamChannels == 1 ? 0 : side;
+
+            addTerm(output, side, scale);
+
+            if (asioChannels >= 4) {
+                addTerm(output, rear + side, kMinus3dB * scale);
+            }
+
+            if (asioChannels >= 6) {
+                addTerm(output, 2, kMinus3dB * scale);
+            }
+
+            if (asioChannels == 8) {
+                addTerm(output, 6 + side, kMinus3dB * scale);
+            }
+        }
+    } else {
+        for (int i = 0; i < outputs && i < inputs; ++i) {
+            addTerm(i, i, 1.0f);
+        }
+    }
+
+    finish();
+}
+
+void ChannelMix::finish()
+{
+    kind = Identity;
+
+    for (int output = 0; output < outputs; ++output) {
+        auto count = termCounts[output];
+        auto& term = terms[output][0];
+
+        if (count > 1 || (count == 1 && term.gain != 1.0f)) {
+            kind = Matrix;
+            return;
+        }
+
+        if (count == 1 && term.input != output) {
+            kind = Copy;
+        } else if (count == 0 && output < inputs) {
+            kind = Copy;
+        }
+    }
+}
+
+} // namespace Sar
@@ -0,0 +1,171 @@
+// SynchronousAudioRouter
+// Copyright (C) 2015 Mackenzie Straight
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SynchronousAudioRouter.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef _SAR_ASIO_DSP_H
+#define _SAR_ASIO_DSP_H
+
+#include "sar.h"
+
+namespace Sar {
+
+// Alignment of the virtual channel buffers SarAsio allocates. Each one is
+// padded to a multiple of it as well, so vector loops over them never
+// split a cache line and may run over the last frame up to the boundary.
+// Buffers owned by the inner driver make no such promise, and neither do the
+// slices of a buffer the wrapper splits into sub-ticks, which follow each
+// other with no padding since the host sees the buffer as one.
+#define SAR_BUFFER_ALIGNMENT 64
+
+// Conversions between the interleaved integer PCM in endpoint buffers and
+// the 32-bit float buses the driver mixes in. Samples are little-endian
+// signed integers of sampleSize (2, 3 or 4) bytes; stride is the distance in
+// bytes between consecutive frames of the channel being converted.
+void DecodeChannel(
+    float *dst, const void *src, size_t frames, size_t stride,
+    int sampleSize);
+
+// Copies samples between two strided channels of the same format.
+void CopyChannel(
+    void *dst, size_t dstStride, const void *src, size_t srcStride,
+    size_t frames, int sampleSize);
+
+// Per-channel state for TPDF dither with first order noise shaping, applied
+// when floats are narrowed to 16 or 24 bit samples.
+struct DitherState
+{
+    uint32_t seed;
+    float error;
+
+    void reset(uint32_t newSeed)
+    {
+        seed = newSeed ? newSeed : 1;
+        error = 0;
+    }
+
+    // Uniform in [-0.5, 0.5), one xorshift32 step.
+    float next()
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed * (1.0f / 4294967296.0f) - 0.5f;
+    }
+};
+
+// Writes a float channel over interleaved PCM, saturating at full scale.
+// Narrowing to 16 or 24 bits is dithered when dither is given.
+void EncodeChannel(
+    void *dst, const float *src, size_t frames, size_t stride,
+    int sampleSize, DitherState *dither = nullptr);
+
+// Adds a float channel into interleaved PCM, saturating at full scale.
+void AccumulateChannel(
+    void *dst, const float *src, size_t frames, size_t stride,
+    int sampleSize, DitherState *dither = nullptr);
+
+// dst[i] += gain * src[i]
+void MultiplyAccumulate(
+    float *dst, const float *src, float gain, size_t frames);
+
+#define SAR_RESAMPLER_TAPS 32
+#define SAR_RESAMPLER_PHASES 256
+
+// Fixed ratio rate conversion of up to SAR_MAX_CHANNEL_COUNT planar float
+// channels. The filter is a Blackman windowed sinc tabulated at
+// SAR_RESAMPLER_PHASES fractional offsets, with coefficients interpolated
+// between neighbouring offsets, so any pair of rates works without a table
+// per ratio. Output lags input by SAR_RESAMPLER_TAPS / 2 input frames.
+struct Resampler
+{
+    // Allocates for at most maxInputFrames per process call; not for the
+    // audio thread.
+    void init(
+        int inputRate, int outputRate, int channels, size_t maxInputFrames);
+
+    // The input frames the next process call needs to make outputFrames,
+    // and the output frames it makes from inputFrames.
+    size_t inputFramesFor(size_t outputFrames) const;
+    size_t outputFramesFor(size_t inputFrames) const;
+
+    // Where the next inputFrames of a channel are written before process.
+    float *input(int channel)
+    {
+        return &_inputs[channel * _inputStride + SAR_RESAMPLER_TAPS];
+    }
+
+    const float *output(int channel) const
+    {
+        return &_outputs[channel * _outputStride];
+    }
+
+    // Converts the first channels. The frame counts must be a pair given by
+    // inputFramesFor or outputFramesFor.
+    void process(int channels, size_t inputFrames, size_t outputFrames);
+
+private:
+    double _step; // input frames per output frame
+    double _position; // of the next output frame, in _inputs frames
+    size_t _inputStride;
+    size_t _outputStride;
+    std::vector<float> _table; // SAR_RESAMPLER_PHASES + 1 rows of taps
+    std::vector<float> _inputs; // per channel: history, then new input
+    std::vector<float> _outputs;
+};
+
+#define SAR_MAX_MIX_TERMS 8
+
+// A small channel matrix: each output channel is the gain-weighted sum of up
+// to SAR_MAX_MIX_TERMS input channels. Fixed size so it can be rebuilt on
+// the audio thread when a stream's channel count changes.
+struct ChannelMix
+{
+    struct Term
+    {
+        int input;
+        float gain;
+    };
+
+    enum Kind
+    {
+        Identity,   // output i is input i, extra outputs silent
+        Copy,       // every output is at most one input at unity gain
+        Matrix      // anything else
+    };
+
+    Kind kind;
+    int inputs;
+    int outputs;
+    int termCounts[SAR_MAX_CHANNEL_COUNT];
+    Term terms[SAR_MAX_CHANNEL_COUNT][SAR_MAX_MIX_TERMS];
+
+    // channelMap is indexed by ASIO channel and gives the stream channel it
+    // carries, or -1. When empty and standard is set, the usual mono and
+    // stereo up/downmixes are used for the layouts they apply to. Playback
+    // maps stream channels (inputs) to ASIO channels (outputs); recording
+    // maps ASIO channels (inputs) to stream channels (outputs).
+    void build(
+        bool playback, int streamChannels, int asioChannels,
+        const std::vector<int>& channelMap, bool standard);
+
+private:
+    void addTerm(int output, int input, float gain);
+    void finish();
+};
+
+} // namespace Sar
+
+#endif // _SAR_ASIO_DSP_H
@@ -113,8 +113,6 @@ SarMMDeviceEnumerator::SarMMDeviceEnumerator()
     LOG(INFO) << "Initializing SarMMDeviceEnumerator.";
     HRESULT hr;
 
-    _config = DriverConfig::fromFile(ConfigurationPath(L"default.json"));
-
     hr = CreateMMDevAPIObject(
         __uuidof(MMDeviceEnumerator), __uuidof(IMMDeviceEnumerator),
         (LPVOID *)&_innerEnumerator);
@@ -128,6 +126,17 @@ SarMMDeviceEnumerator::SarMMDeviceEnumerator()
 
 SarMMDeviceEnumerator::~SarMMDeviceEnumerator()
 {
+    if (_mmNotificationClientRegistered) {
+        _innerEnumerator->UnregisterEndpointNotificationCallback(
+            _mmNotificationClient);
+        _mmNotificationClientRegistered = false;
+    }
+
+    if (_mmNotificationClient) {
+        _mmNotificationClient->Release();
+        _mmNotificationClient = nullptr;
+    }
+
     _innerEnumerator = nullptr;
 }
 
@@ -193,47 +202,173 @@ HRESULT STDMETHODCALLTYPE SarMMDeviceEnumerator::GetDefaultAudioEndpoint(
         return E_FAIL;
     }
 
+    std::call_once(_routingOnce, [this]() { initializeRouting(); });
+
     if (!_config.enableApplicationRouting) {
         return _innerEnumerator->GetDefaultAudioEndpoint(
             dataFlow, role, ppEndpoint);
     }
 
-    CComPtr<IMMDeviceCollection> devices;
     CComPtr<IMMDevice> foundDevice;
-    UINT deviceCount;
+    ApplicationConfig *appConfig = _applicationConfig;
+    DefaultEndpointConfig *endpointConfig = nullptr;
+    std::wstring deviceId;
+
+    if (!appConfig) {
+        return _innerEnumerator->GetDefaultAudioEndpoint(
+                dataFlow, role, ppEndpoint);
+    }
+
+    for (auto& defaultEndpoint : appConfig->defaults) {
+        if (role == defaultEndpoint.role &&
+            dataFlow == defaultEndpoint.type) {
+
+            endpointConfig = &defaultEndpoint;
+            break;
+        }
+    }
+
+    if (endpointConfig &&
+        findEndpointDeviceId(dataFlow, endpointConfig->id, deviceId) &&
+        SUCCEEDED(_innerEnumerator->GetDevice(
+            deviceId.c_str(), &foundDevice))) {
+
+        *ppEndpoint = foundDevice.Detach();
+        return S_OK;
+    }
+
+    return _innerEnumerator->GetDefaultAudioEndpoint(
+        dataFlow, role, ppEndpoint);
+}
+
+// Only GetDefaultAudioEndpoint consults the routing config, so processes that
+// just enumerate devices never load it.
+void SarMMDeviceEnumerator::initializeRouting()
+{
+    ApplicationMatcher matcher;
     WCHAR processNameWide[512] = {};
-    ApplicationConfig *appConfig = nullptr;
 
+    _config = DriverConfig::fromFile(ConfigurationPath(L"default.json"));
+
+    if (!_config.enableApplicationRouting) {
+        return;
+    }
+
+    // The image path can't change for the life of the process, so the rules
+    // only need to run once.
     GetModuleFileName(nullptr, processNameWide, sizeof(processNameWide)/sizeof(processNameWide[0]));
+    matcher.build(_config.applications);
 
-    auto processName = std::wstring(processNameWide);
+    int index = matcher.match(std::wstring(processNameWide));
 
-    for (auto& candidateApp : _config.applications) {
-        if (std::regex_search(processName, candidateApp.pattern)) {
-            appConfig = &candidateApp;
-            break;
+    _applicationConfig = index >= 0 ? &_config.applications[index] : nullptr;
+}
+
+bool SarMMDeviceEnumerator::findEndpointDeviceId(
+    EDataFlow dataFlow,
+    const std::string& endpointId,
+    std::wstring& deviceId)
+{
+    if (dataFlow != eRender && dataFlow != eCapture) {
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(_endpointIdCacheMutex);
+
+    if (!_endpointIdCache) {
+        _endpointIdCache = std::make_shared<EndpointIdCache>();
+
+        if (SUCCEEDED(CComObject<NotificationClient>::CreateInstance(
+            &_mmNotificationClient))) {
+
+            _mmNotificationClient->AddRef();
+            _mmNotificationClient->setCache(_endpointIdCache);
+            _mmNotificationClientRegistered = SUCCEEDED(
+                _innerEnumerator->RegisterEndpointNotificationCallback(
+                    _mmNotificationClient));
         }
     }
 
-    if (!appConfig) {
-        return _innerEnumerator->GetDefaultAudioEndpoint(
-                dataFlow, role, ppEndpoint);
+    auto cache = _endpointIdCache;
+    bool registered = _mmNotificationClientRegistered;
+    int flow = dataFlow == eRender ? 0 : 1;
+
+    lock.unlock();
+
+    // Without a registered notification client we'd never hear about
+    // changes, so fall back to scanning every time.
+    if (registered) {
+        std::lock_guard<std::mutex> cacheLock(cache->mutex);
+
+        if (cache->built[flow] &&
+            cache->builtGeneration[flow] == cache->generation) {
+
+            auto it = cache->deviceIds[flow].find(endpointId);
+
+            if (it == cache->deviceIds[flow].end()) {
+                return false;
+            }
+
+            deviceId = it->second;
+            return true;
+        }
     }
 
+    // Scan without holding the lock, since device notifications can arrive
+    // while MMDevAPI is busy enumerating. A change that lands during the scan
+    // bumps the generation and keeps the result from being published.
+    std::unordered_map<std::string, std::wstring> deviceIds;
+    unsigned generation = cache->generation;
+
+    // A failed scan isn't cached, so the next lookup tries again.
+    if (!scanEndpointDeviceIds(dataFlow, deviceIds)) {
+        return false;
+    }
+
+    auto it = deviceIds.find(endpointId);
+    bool found = it != deviceIds.end();
+
+    if (found) {
+        deviceId = it->second;
+    }
+
+    if (registered) {
+        std::lock_guard<std::mutex> cacheLock(cache->mutex);
+
+        if (cache->generation == generation) {
+            cache->deviceIds[flow] = std::move(deviceIds);
+            cache->builtGeneration[flow] = generation;
+            cache->built[flow] = true;
+        }
+    }
+
+    return found;
+}
+
+bool SarMMDeviceEnumerator::scanEndpointDeviceIds(
+    EDataFlow dataFlow,
+    std::unordered_map<std::string, std::wstring>& deviceIds)
+{
+    CComPtr<IMMDeviceCollection> devices;
+    UINT deviceCount;
+
     if (!SUCCEEDED(_innerEnumerator->EnumAudioEndpoints(
         dataFlow, DEVICE_STATE_ACTIVE, &devices))) {
 
-        return E_FAIL;
+        LOG(ERROR) << "Couldn't enumerate audio endpoints.";
+        return false;
     }
 
     if (!SUCCEEDED(devices->GetCount(&deviceCount))) {
-        return E_FAIL;
+        LOG(ERROR) << "Couldn't count audio endpoints.";
+        return false;
     }
 
-    for (UINT i = 0; i < deviceCount && !foundDevice; ++i) {
+    for (UINT i = 0; i < deviceCount; ++i) {
         CComPtr<IMMDevice> device;
         CComPtr<IPropertyStore> ps;
         PROPVARIANT pvalue = {};
+        LPWSTR deviceId = nullptr;
 
         if (!SUCCEEDED(devices->Item(i, &device))) {
             continue;
@@ -249,30 +384,16 @@ HRESULT STDMETHODCALLTYPE SarMMDeviceEnumerator::GetDefaultAudioEndpoint(
             continue;
         }
 
-        if (pvalue.vt == VT_LPWSTR) {
-            auto candidateId = TCHARToUTF8(pvalue.pwszVal);
-
-            for (auto& defaultEndpoint : appConfig->defaults) {
-                if (role == defaultEndpoint.role &&
-                    dataFlow == defaultEndpoint.type &&
-                    candidateId == defaultEndpoint.id) {
-
-                    foundDevice = device;
-                    break;
-                }
-            }
+        if (pvalue.vt == VT_LPWSTR && SUCCEEDED(device->GetId(&deviceId))) {
+            // Keep the first device for an id, as the old linear scan did.
+            deviceIds.emplace(TCHARToUTF8(pvalue.pwszVal), deviceId);
+            CoTaskMemFree(deviceId);
         }
 
         PropVariantClear(&pvalue);
     }
 
-    if (foundDevice) {
-        *ppEndpoint = foundDevice.Detach();
-        return S_OK;
-    }
-
-    return _innerEnumerator->GetDefaultAudioEndpoint(
-        dataFlow, role, ppEndpoint);
+    return true;
 }
 
 HRESULT STDMETHODCALLTYPE SarMMDeviceEnumerator::GetDevice(
@@ -457,4 +578,57 @@ HRESULT STDMETHODCALLTYPE SarActivateAudioInterfaceWorker::GetActivateResult(
         activateResult, activatedInterface);
 }
 
+void SarMMDeviceEnumerator::NotificationClient::invalidate()
+{
+    if (auto cache = _cache.lock()) {
+        cache->generation++;
+    }
+}
+
+HRESULT STDMETHODCALLTYPE
+SarMMDeviceEnumerator::NotificationClient::OnDeviceStateChanged(
+    _In_  LPCWSTR pwstrDeviceId,
+    _In_  DWORD dwNewState)
+{
+    invalidate();
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE
+SarMMDeviceEnumerator::NotificationClient::OnDeviceAdded(
+    _In_  LPCWSTR pwstrDeviceId)
+{
+    invalidate();
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE
+SarMMDeviceEnumerator::NotificationClient::OnDeviceRemoved(
+    _In_  LPCWSTR pwstrDeviceId)
+{
+    invalidate();
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE
+SarMMDeviceEnumerator::NotificationClient::OnDefaultDeviceChanged(
+    _In_  EDataFlow flow,
+    _In_  ERole role,
+    _In_  LPCWSTR pwstrDefaultDeviceId)
+{
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE
+SarMMDeviceEnumerator::NotificationClient::OnPropertyValueChanged(
+    _In_  LPCWSTR pwstrDeviceId,
+    _In_  const PROPERTYKEY key)
+{
+    if (IsEqualPropertyKey(key, PKEY_SynchronousAudioRouter_EndpointId)) {
+        invalidate();
+    }
+
+    return S_OK;
+}
+
 } // namespace Sar
\ No newline at end of file
@@ -56,7 +56,69 @@ struct ATL_NO_VTABLE SarMMDeviceEnumerator:
         _In_ IMMNotificationClient *pClient) override;
 
 private:
+    // Maps SAR endpoint ids to IMMDevice ids, one table per data flow. Built
+    // on the first routed lookup and dropped whenever devices change.
+    struct EndpointIdCache
+    {
+        std::mutex mutex;
+        std::atomic<unsigned> generation{0};
+        bool built[2] = {};
+        unsigned builtGeneration[2] = {};
+        std::unordered_map<std::string, std::wstring> deviceIds[2];
+    };
+
+    struct ATL_NO_VTABLE NotificationClient:
+        public CComObjectRootEx<CComMultiThreadModel>,
+        public IMMNotificationClient
+    {
+        BEGIN_COM_MAP(NotificationClient)
+            COM_INTERFACE_ENTRY(IMMNotificationClient)
+        END_COM_MAP()
+
+        DECLARE_NO_REGISTRY()
+
+        void setCache(std::weak_ptr<EndpointIdCache> cache)
+        {
+            _cache = cache;
+        }
+
+        virtual HRESULT STDMETHODCALLTYPE OnDeviceStateChanged(
+            _In_  LPCWSTR pwstrDeviceId,
+            _In_  DWORD dwNewState) override;
+        virtual HRESULT STDMETHODCALLTYPE OnDeviceAdded(
+            _In_  LPCWSTR pwstrDeviceId) override;
+        virtual HRESULT STDMETHODCALLTYPE OnDeviceRemoved(
+            _In_  LPCWSTR pwstrDeviceId) override;
+        virtual HRESULT STDMETHODCALLTYPE OnDefaultDeviceChanged(
+            _In_  EDataFlow flow,
+            _In_  ERole role,
+            _In_  LPCWSTR pwstrDefaultDeviceId) override;
+        virtual HRESULT STDMETHODCALLTYPE OnPropertyValueChanged(
+            _In_  LPCWSTR pwstrDeviceId,
+            _In_  const PROPERTYKEY key) override;
+
+    private:
+        void invalidate();
+
+        std::weak_ptr<EndpointIdCache> _cache;
+    };
+
+    void initializeRouting();
+    bool findEndpointDeviceId(
+        EDataFlow dataFlow,
+        const std::string& endpointId,
+        std::wstring& deviceId);
+    bool scanEndpointDeviceIds(
+        EDataFlow dataFlow,
+        std::unordered_map<std::string, std::wstring>& deviceIds);
+
+    std::once_flag _routingOnce;
     DriverConfig _config;
+    ApplicationConfig *_applicationConfig = nullptr;
+    std::mutex _endpointIdCacheMutex;
+    std::shared_ptr<EndpointIdCache> _endpointIdCache;
+    CComObject<NotificationClient> *_mmNotificationClient = nullptr;
+    bool _mmNotificationClientRegistered = false; // under _endpointIdCacheMutex
     CComPtr<IMMDeviceEnumerator> _innerEnumerator;
 };
 
@@ -21,20 +21,51 @@
 
 namespace Sar {
 
+void BufferConfig::setEndpoints(
+    const std::vector<EndpointConfig>& newEndpoints, int bufferCount)
+{
+    size_t channelCount = 0;
+
+    endpoints = newEndpoints;
+    channelOffsets.clear();
+
+    for (auto& endpoint : endpoints) {
+        channelOffsets.push_back(channelCount);
+        channelCount += endpoint.channelCount;
+    }
+
+    channelOffsets.push_back(channelCount);
+
+    asioBuffers.assign(bufferCount, std::vector<void *>(channelCount));
+}
+
 SarClient::SarClient(
     const DriverConfig& driverConfig,
     const BufferConfig& bufferConfig)
     : _driverConfig(driverConfig), _bufferConfig(bufferConfig),
       _device(INVALID_HANDLE_VALUE), _completionPort(nullptr),
+      _sharedBuffer(nullptr), _sharedBufferSize(0),
+      _registers(nullptr), _clockRegisters(nullptr),
       _handleQueueStarted(false)
 {
     ZeroMemory(&_handleQueueCompletion, sizeof(HandleQueueCompletion));
+    _mixScratch.resize(bufferConfig.periodFrameSize);
+    _mixAccumulator.resize(bufferConfig.periodFrameSize);
+}
+
+SarClient::~SarClient()
+{
+    stop();
 }
 
 void SarClient::tick(long bufferIndex)
 {
-    ATLASSERT(bufferIndex == 0 || bufferIndex == 1);
+    ATLASSERT(bufferIndex >= 0 &&
+        bufferIndex < (long)_bufferConfig.asioBuffers.size());
     bool hasUpdatedNotificationHandles = false;
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter(&now);
 
     // tick might be called from a different thread than the main thread.
     // guard against concurrent tick and close which cause the _sharedBuffer
@@ -43,6 +74,18 @@ void SarClient::tick(long bufferIndex)
     if (!_registers)
         return;
 
+    if (_startCounter) {
+        LARGE_INTEGER frequency;
+
+        QueryPerformanceFrequency(&frequency);
+        LOG(INFO) << "First tick "
+            << (now.QuadPart - _startCounter) * 1000.0 / frequency.QuadPart
+            << " ms after start.";
+        _startCounter = 0;
+    }
+
+    _clock.tick(now.QuadPart);
+
     if (_updateSampleRateOnTick.exchange(false)) {
         DWORD dummy;
 
@@ -50,6 +93,15 @@ void SarClient::tick(long bufferIndex)
             nullptr, 0, nullptr, 0, &dummy, nullptr);
     }
 
+    for (auto& route : _routes) {
+        for (auto& ret : route.returns) {
+            if (ret.active) {
+                std::fill(ret.bus.begin(), ret.bus.end(), 0.0f);
+                ret.active = false;
+            }
+        }
+    }
+
     // for each endpoint
     // read isActive, generation and buffer offset/size/position
     //   if offset/size invalid, skip endpoint (fill asio buffers with 0)
@@ -60,20 +112,25 @@ void SarClient::tick(long bufferIndex)
     // read isActive, generation
     //   if conflicted, skip endpoint and fill asio frames with 0
     // else increment position register
-    for (size_t i = 0; i < _driverConfig.endpoints.size(); ++i) {
-        auto& endpoint = _driverConfig.endpoints[i];
-        auto& asioBuffers = _bufferConfig.asioBuffers[bufferIndex][i];
-        auto asioBufferSize = (DWORD)(
-            _bufferConfig.periodFrameSize * _bufferConfig.sampleSize);
+    for (auto& route : _routes) {
+        route.clockAdvanced = false;
+
+        auto i = route.registerIndex;
+        auto asioBuffers =
+            _bufferConfig.asioBuffers[bufferIndex].data() + route.asioOffset;
+        auto asioBufferSize = route.asioBufferSize;
         auto activeChannelCount = _registers[i].activeChannelCount;
         auto generation = _registers[i].generation;
         auto endpointBufferOffset = _registers[i].bufferOffset;
         auto endpointBufferSize = _registers[i].bufferSize;
         auto positionRegister = _registers[i].positionRegister;
-        auto ntargets = (int)asioBuffers.size();
+        auto ntargets = route.asioChannelCount;
         auto frameChunkSize = asioBufferSize * activeChannelCount;
         auto notificationCount = _registers[i].notificationCount;
 
+        route.clockGeneration = generation;
+        route.clockBase = _registers[i].clockRegister;
+
         if (!hasUpdatedNotificationHandles && notificationCount &&
             (GENERATION_NUMBER(generation) !=
              GENERATION_NUMBER(_notificationHandles[i].generation))) {
@@ -96,6 +153,19 @@ void SarClient::tick(long bufferIndex)
             continue;
         }
 
+        // A converted endpoint moves however many of its own frames the
+        // resampler needs for, or makes from, one ASIO period.
+        if (route.resampled) {
+            auto frames = route.type == EndpointType::Playback ?
+                route.resampler.inputFramesFor(
+                    _bufferConfig.periodFrameSize) :
+                route.resampler.outputFramesFor(
+                    _bufferConfig.periodFrameSize);
+
+            frameChunkSize = (DWORD)
+                (frames * _bufferConfig.sampleSize * activeChannelCount);
+        }
+
         auto nextPositionRegister =
             (positionRegister + frameChunkSize) % endpointBufferSize;
         auto position = positionRegister + endpointBufferOffset;
@@ -105,18 +175,91 @@ void SarClient::tick(long bufferIndex)
         auto firstSize = min(frameChunkSize, endpointBufferSize - positionRegister);
         auto secondSize = frameChunkSize - firstSize;
 
-        if (endpoint.type == EndpointType::Playback) {
-            demux(
+        if (route.channelMixStreamChannels != (int)activeChannelCount) {
+            route.channelMix.build(
+                route.type == EndpointType::Playback,
+                activeChannelCount, ntargets,
+                route.channelMap, route.standardMix);
+            route.channelMixStreamChannels = activeChannelCount;
+        }
+
+        if (route.type == EndpointType::Playback) {
+            delayEndpoint(route,
                 endpointDataFirst, firstSize,
-                endpointDataSecond, secondSize,
-                asioBuffers.data(), ntargets, activeChannelCount,
-                asioBufferSize, _bufferConfig.sampleSize);
+                endpointDataSecond, secondSize, activeChannelCount,
+                generation);
+
+            if (route.resampled) {
+                resamplePlayback(route,
+                    endpointDataFirst, firstSize,
+                    endpointDataSecond, secondSize,
+                    asioBuffers, ntargets, activeChannelCount);
+            } else if (route.channelMix.kind == ChannelMix::Identity) {
+                demux(
+                    endpointDataFirst, firstSize,
+                    endpointDataSecond, secondSize,
+                    asioBuffers, ntargets, activeChannelCount,
+                    asioBufferSize, _bufferConfig.sampleSize);
+            } else {
+                demuxMixed(route,
+                    endpointDataFirst, firstSize,
+                    endpointDataSecond, secondSize,
+                    asioBuffers, ntargets, activeChannelCount);
+            }
+
+            // Send sources are read here, covered by the late generation
+            // check, but only mixed into the buses once it passes.
+            for (auto& send : route.sends) {
+                if (!route.resampled &&
+                    send.channel < (int)activeChannelCount) {
+
+                    decodeEndpointChannel(send.source.data(),
+                        endpointDataFirst, firstSize,
+                        endpointDataSecond, secondSize,
+                        send.channel, activeChannelCount);
+                }
+            }
         } else {
-            mux(
+            if (route.resampled) {
+                resampleRecording(route,
+                    endpointDataFirst, firstSize,
+                    endpointDataSecond, secondSize,
+                    asioBuffers, ntargets, activeChannelCount);
+            } else if (route.asioSlot < 0) {
+                // Added since the host last reset, so there are no ASIO
+                // channels to record from yet.
+                ZeroMemory(endpointDataFirst, firstSize);
+                ZeroMemory(endpointDataSecond, secondSize);
+            } else if (route.channelMix.kind == ChannelMix::Identity) {
+                mux(
+                    endpointDataFirst, firstSize,
+                    endpointDataSecond, secondSize,
+                    asioBuffers, ntargets, activeChannelCount,
+                    asioBufferSize, _bufferConfig.sampleSize);
+            } else {
+                muxMixed(route,
+                    endpointDataFirst, firstSize,
+                    endpointDataSecond, secondSize,
+                    asioBuffers, ntargets, activeChannelCount);
+            }
+
+            // Channels no send reached this tick keep the bit exact mux,
+            // rather than being requantized with dither for a silent bus.
+            for (auto& ret : route.returns) {
+                if (ret.active && !route.resampled &&
+                    ret.channel < (int)activeChannelCount) {
+                    accumulateEndpointChannel(ret.bus.data(),
+                        endpointDataFirst, firstSize,
+                        endpointDataSecond, secondSize,
+                        ret.channel, activeChannelCount,
+                        route.ditherFor(ret.channel));
+                }
+            }
+
+            delayEndpoint(route,
                 endpointDataFirst, firstSize,
-                endpointDataSecond, secondSize,
-                asioBuffers.data(), ntargets, activeChannelCount,
-                asioBufferSize, _bufferConfig.sampleSize);
+                endpointDataSecond, secondSize, activeChannelCount,
+                generation);
         }
 
         auto lateGeneration = _registers[i].generation;
@@ -134,6 +277,20 @@ void SarClient::tick(long bufferIndex)
                 }
             }
         } else {
+            for (auto& send : route.sends) {
+                auto& ret = _routes[send.route].returns[send.ret];
+
+                if (send.channel >= (int)activeChannelCount) {
+                    continue;
+                }
+
+                MultiplyAccumulate(ret.bus.data(), route.resampled ?
+                        route.resampler.output(send.channel) :
+                        send.source.data(),
+                    send.gain, ret.bus.size());
+                ret.active = true;
+            }
+
             // Check if we need to notify client given NotificationCount from KSRTAUDIO_BUFFER_PROPERTY_WITH_NOTIFICATION
             // If NotificationCount == 1, notify only when crossing end of ring buffer
             // If NotificationCount == 2, notify at the mid-point and end of the ring buffer
@@ -160,6 +317,7 @@ void SarClient::tick(long bufferIndex)
                      GENERATION_NUMBER(generation))) {
 
                     _registers[i].positionRegister = nextPositionRegister;
+                    route.clockAdvanced = true;
 
                     if (!SetEvent(evt)) {
                         LOG(ERROR) << "SetEvent error " << GetLastError();
@@ -175,13 +333,21 @@ void SarClient::tick(long bufferIndex)
             } else {
                 // No notification needed, just update the position register
                 _registers[i].positionRegister = nextPositionRegister;
+                route.clockAdvanced = true;
             }
         }
     }
+
+    publishClock();
 }
 
 bool SarClient::start()
 {
+    LARGE_INTEGER startCounter, endpointsCounter, frequency;
+
+    QueryPerformanceCounter(&startCounter);
+    QueryPerformanceFrequency(&frequency);
+
     if (!openControlDevice()) {
         LOG(ERROR) << "Couldn't open control device";
         return false;
@@ -205,15 +371,29 @@ bool SarClient::start()
         return false;
     }
 
+    QueryPerformanceCounter(&endpointsCounter);
+    LOG(INFO) << "Created " << _driverConfig.endpoints.size()
+        << " endpoints in "
+        << (endpointsCounter.QuadPart - startCounter.QuadPart) * 1000.0 /
+            frequency.QuadPart
+        << " ms.";
+
     if (_driverConfig.enableApplicationRouting && !enableRegistryFilter()) {
         LOG(ERROR) << "Couldn't enable registry filter";
     }
 
+    {
+        std::lock_guard<std::mutex> registersLockGuard(_registersLock);
+        _startCounter = startCounter.QuadPart;
+    }
+
     return true;
 }
 
 void SarClient::stop()
 {
+    stopIdleThread();
+
     if (_mmNotificationClientRegistered) {
         _mmEnumerator->UnregisterEndpointNotificationCallback(
             _mmNotificationClient);
@@ -234,8 +414,16 @@ void SarClient::stop()
         CancelIoEx(_device, nullptr);
         CloseHandle(_device);
 
+        if (_clock.tickCount()) {
+            LOG(INFO) << "Tick clock: " << _clock.tickCount() << " ticks, "
+                << _clock.sampleRate() << " Hz effective, jitter "
+                << _clock.jitterRms() * 1e6 << " us rms, "
+                << _clock.jitterMax() * 1e6 << " us max";
+        }
+
         _device = INVALID_HANDLE_VALUE;
         _registers = nullptr;
+        _clockRegisters = nullptr;
         _sharedBuffer = nullptr;
         _sharedBufferSize = 0;
         _registersLock.unlock();
@@ -311,8 +499,10 @@ bool SarClient::openControlDevice()
         return false;
     }
 
+    // Register indices aren't reused when endpoints are removed, so size for
+    // every index up front rather than resizing (and closing handles) later.
     _notificationHandles.clear();
-    _notificationHandles.resize(_driverConfig.endpoints.size());
+    _notificationHandles.resize(SAR_MAX_ENDPOINT_COUNT);
     free(interfaceDetail);
     return true;
 }
@@ -372,33 +562,490 @@ bool SarClient::setBufferLayout()
     _sharedBufferSize = response.actualSize;
     _registers = (SarEndpointRegisters *)
         ((char *)response.virtualAddress + response.registerBase);
+    _clockRegisters = (SarClockRegisters *)
+        ((char *)_registers + SAR_CLOCK_REGISTER_OFFSET);
+
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceFrequency(&frequency);
+    _clock.reset(
+        _bufferConfig.periodFrameSize, _bufferConfig.sampleRate,
+        frequency.QuadPart);
     return true;
 }
 
 bool SarClient::createEndpoints()
 {
-    int i = 0;
-    DWORD dummy;
+    std::vector<const EndpointConfig *> endpoints;
 
     for (auto& endpoint : _driverConfig.endpoints) {
-        SarCreateEndpointRequest request = {};
+        endpoints.push_back(&endpoint);
+    }
+
+    if (!createEndpoints(endpoints)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> registersLockGuard(_registersLock);
+    _routes = buildRoutes(_driverConfig);
+    return true;
+}
+
+// Creates all the endpoints with a single SAR_CREATE_ENDPOINTS, which lets
+// the driver register their device interfaces in one pass instead of one
+// round trip per endpoint.
+bool SarClient::createEndpoints(
+    const std::vector<const EndpointConfig *>& endpoints)
+{
+    std::vector<SarCreateEndpointRequest> requests(endpoints.size());
+    int firstIndex = _nextRegisterIndex;
+    DWORD dummy;
+
+    if (endpoints.empty()) {
+        return true;
+    }
+
+    // Some of the batch may have been created even if the request fails, so
+    // never hand these indices out again.
+    _nextRegisterIndex += (int)endpoints.size();
+
+    for (size_t i = 0; i < endpoints.size(); ++i) {
+        auto& endpoint = *endpoints[i];
+        auto& request = requests[i];
 
         request.type = endpoint.type == EndpointType::Playback ?
             SAR_ENDPOINT_TYPE_PLAYBACK : SAR_ENDPOINT_TYPE_RECORDING;
         request.channelCount = endpoint.channelCount;
-        request.index = i++;
+        request.sampleRate = endpoint.sampleRate;
+        request.index = firstIndex + (DWORD)i;
         wcscpy_s(request.name, endpoint.description.c_str());
         wcscpy_s(request.id, UTF8ToWide(endpoint.id).c_str());
+    }
+
+    if (!DeviceIoControl(_device, SAR_CREATE_ENDPOINTS,
+        (LPVOID)requests.data(),
+        (DWORD)(requests.size() * sizeof(SarCreateEndpointRequest)),
+        nullptr, 0, &dummy, nullptr)) {
+
+        LOG(ERROR) << "Creation of " << endpoints.size()
+            << " endpoints failed.";
+        return false;
+    }
+
+    for (size_t i = 0; i < endpoints.size(); ++i) {
+        _registerIndices[endpoints[i]->id] = firstIndex + (int)i;
+    }
+
+    return true;
+}
+
+bool SarClient::removeEndpoint(int registerIndex)
+{
+    SarRemoveEndpointRequest request = {};
+    DWORD dummy;
+
+    request.index = registerIndex;
+
+    if (!DeviceIoControl(_device, SAR_REMOVE_ENDPOINT,
+        (LPVOID)&request, sizeof(request), nullptr, 0, &dummy, nullptr)) {
+
+        LOG(ERROR) << "Endpoint removal for register " << registerIndex
+           << " failed.";
+        return false;
+    }
+
+    return true;
+}
+
+std::vector<SarClient::EndpointRoute> SarClient::buildRoutes(
+    const DriverConfig& driverConfig)
+{
+    std::vector<EndpointRoute> routes;
+    std::vector<const EndpointConfig *> ordered;
+    std::unordered_map<std::string, size_t> routeIndices;
+
+    for (auto& endpoint : driverConfig.endpoints) {
+        if (endpoint.type == EndpointType::Playback) {
+            ordered.push_back(&endpoint);
+        }
+    }
+
+    for (auto& endpoint : driverConfig.endpoints) {
+        if (endpoint.type == EndpointType::Recording) {
+            ordered.push_back(&endpoint);
+        }
+    }
+
+    for (auto endpointPtr : ordered) {
+        auto& endpoint = *endpointPtr;
+        EndpointRoute route = {};
+
+        route.type = endpoint.type;
+        route.registerIndex = _registerIndices[endpoint.id];
+        route.asioSlot = -1;
+        route.asioOffset = 0;
+        route.asioChannelCount = 0;
+        route.asioBufferSize = (DWORD)(
+            _bufferConfig.periodFrameSize * _bufferConfig.sampleSize);
+        route.channelMap = endpoint.channelMap;
+        route.standardMix = endpoint.standardMix;
+        route.channelMixStreamChannels = -1;
+        route.delayFrames = endpoint.delayFrames;
+        route.delayChannels = -1;
+        route.delayGeneration = 0;
+        route.delayPosition = 0;
+        route.delayLine.resize((size_t)endpoint.delayFrames *
+            endpoint.channelCount * _bufferConfig.sampleSize);
+        route.dither = driverConfig.dither;
+        route.resampled = endpoint.sampleRate &&
+            endpoint.sampleRate != _bufferConfig.sampleRate;
+
+        if (route.resampled) {
+            if (endpoint.type == EndpointType::Playback) {
+                route.resampler.init(
+                    endpoint.sampleRate, _bufferConfig.sampleRate,
+                    endpoint.channelCount,
+                    (size_t)_bufferConfig.periodFrameSize *
+                        endpoint.sampleRate / _bufferConfig.sampleRate + 2);
+            } else {
+                route.resampler.init(
+                    _bufferConfig.sampleRate, endpoint.sampleRate,
+                    endpoint.channelCount, _bufferConfig.periodFrameSize);
+            }
+        }
+
+        // Distinct seeds keep the dither of neighbouring channels
+        // uncorrelated.
+        for (size_t channel = 0; channel < route.ditherStates.size();
+             ++channel) {
+
+            route.ditherStates[channel].reset((uint32_t)(
+                (route.registerIndex * SAR_MAX_CHANNEL_COUNT + channel + 1) *
+                2654435761u));
+        }
+
+        for (size_t slot = 0; slot < _bufferConfig.endpoints.size(); ++slot) {
+            auto& slotEndpoint = _bufferConfig.endpoints[slot];
+
+            if (slotEndpoint.id == endpoint.id &&
+                slotEndpoint.type == endpoint.type &&
+                slotEndpoint.channelCount == endpoint.channelCount) {
+
+                route.asioSlot = (int)slot;
+                route.asioOffset = _bufferConfig.channelOffsets[slot];
+                route.asioChannelCount = (int)(
+                    _bufferConfig.channelOffsets[slot + 1] -
+                    _bufferConfig.channelOffsets[slot]);
+                break;
+            }
+        }
+
+        routeIndices[endpoint.id] = routes.size();
+        routes.push_back(route);
+    }
+
+    for (auto& mix : driverConfig.mixes) {
+        auto from = driverConfig.findEndpoint(mix.from);
+        auto to = driverConfig.findEndpoint(mix.to);
+
+        if (!from || !to ||
+            from->type != EndpointType::Playback ||
+            to->type != EndpointType::Recording ||
+            mix.fromChannel < 0 || mix.fromChannel >= from->channelCount ||
+            mix.toChannel < 0 || mix.toChannel >= to->channelCount) {
+
+            LOG(ERROR) << "Ignoring invalid mix from " << mix.from
+                << " to " << mix.to;
+            continue;
+        }
+
+        MixSend send = {};
+        auto& target = routes[routeIndices[mix.to]];
+
+        send.channel = mix.fromChannel;
+        send.route = routeIndices[mix.to];
+        send.ret = target.returns.size();
+        send.gain = mix.gain;
 
-        if (!DeviceIoControl(_device, SAR_CREATE_ENDPOINT,
-            (LPVOID)&request, sizeof(request), nullptr, 0, &dummy, nullptr)) {
+        if (!routes[routeIndices[mix.from]].resampled) {
+            send.source.resize(_bufferConfig.periodFrameSize);
+        }
+
+        for (size_t i = 0; i < target.returns.size(); ++i) {
+            if (target.returns[i].channel == mix.toChannel) {
+                send.ret = i;
+                break;
+            }
+        }
+
+        if (send.ret == target.returns.size()) {
+            MixReturn ret;
+
+            ret.channel = mix.toChannel;
+            ret.bus.resize(_bufferConfig.periodFrameSize);
+            ret.active = false;
+            target.returns.emplace_back(std::move(ret));
+        }
+
+        routes[routeIndices[mix.from]].sends.push_back(send);
+    }
+
+    return routes;
+}
+
+void SarClient::decodeEndpointChannel(
+    float *dst, void *first, size_t firstSize,
+    void *second, size_t secondSize, int channel, int channelCount)
+{
+    auto sampleSize = _bufferConfig.sampleSize;
+    size_t stride = (size_t)(sampleSize * channelCount);
+    size_t firstFrames = firstSize / stride;
+
+    DecodeChannel(dst, (char *)first + sampleSize * channel,
+        firstFrames, stride, sampleSize);
+    DecodeChannel(dst + firstFrames, (char *)second + sampleSize * channel,
+        secondSize / stride, stride, sampleSize);
+}
+
+void SarClient::accumulateEndpointChannel(
+    const float *src, void *first, size_t firstSize,
+    void *second, size_t secondSize, int channel, int channelCount,
+    DitherState *dither)
+{
+    auto sampleSize = _bufferConfig.sampleSize;
+    size_t stride = (size_t)(sampleSize * channelCount);
+    size_t firstFrames = firstSize / stride;
+
+    AccumulateChannel((char *)first + sampleSize * channel, src,
+        firstFrames, stride, sampleSize, dither);
+    AccumulateChannel((char *)second + sampleSize * channel,
+        src + firstFrames, secondSize / stride, stride, sampleSize, dither);
+}
+
+void SarClient::pause()
+{
+    if (_device == INVALID_HANDLE_VALUE || _idleThread.joinable()) {
+        return;
+    }
+
+    _idleStopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+
+    if (!_idleStopEvent) {
+        LOG(ERROR) << "Couldn't create idle stop event, stopping instead.";
+        stop();
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> registersLockGuard(_registersLock);
+
+        // The host is about to free its buffers, so route every endpoint to
+        // nowhere: playback is drained and recording is fed silence.
+        _bufferConfig.setEndpoints({});
+
+        _routes = buildRoutes(_driverConfig);
+    }
+
+    _idleThread = std::thread(&SarClient::idleLoop, this);
+    LOG(INFO) << "Paused, endpoints kept alive by idle clock.";
+}
+
+bool SarClient::resume(
+    const DriverConfig& driverConfig, const BufferConfig& bufferConfig)
+{
+    LARGE_INTEGER now;
+
+    if (_device == INVALID_HANDLE_VALUE ||
+        bufferConfig.periodFrameSize != _bufferConfig.periodFrameSize ||
+        bufferConfig.sampleRate != _bufferConfig.sampleRate ||
+        bufferConfig.sampleSize != _bufferConfig.sampleSize) {
+
+        return false;
+    }
+
+    // The host may have picked up a new config while we were paused. Apply
+    // it while the idle clock is still running, so added endpoints exist
+    // before their channels are routed.
+    if (!reconfigure(driverConfig, DiffConfig(_driverConfig, driverConfig))) {
+        LOG(INFO) << "Config changed while paused, not resuming.";
+        return false;
+    }
 
-            LOG(ERROR) << "Endpoint creation for " << TCHARToUTF8(endpoint.description.c_str())
-               << " failed.";
+    stopIdleThread();
+    QueryPerformanceCounter(&now);
+
+    std::lock_guard<std::mutex> registersLockGuard(_registersLock);
+    _bufferConfig = bufferConfig;
+    _routes = buildRoutes(_driverConfig);
+    _startCounter = now.QuadPart;
+    LOG(INFO) << "Resumed with existing endpoints.";
+    return true;
+}
+
+void SarClient::stopIdleThread()
+{
+    if (_idleThread.joinable()) {
+        SetEvent(_idleStopEvent);
+        _idleThread.join();
+    }
+
+    if (_idleStopEvent) {
+        CloseHandle(_idleStopEvent);
+        _idleStopEvent = nullptr;
+    }
+}
+
+// Stands in for the host's buffer switch while paused. Deadlines are kept on
+// the performance counter so timer slop doesn't accumulate into drift.
+void SarClient::idleLoop()
+{
+    HANDLE timer = nullptr;
+    LARGE_INTEGER frequency, now, next;
+    long bufferIndex = 0;
+
+#ifdef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+    timer = CreateWaitableTimerEx(nullptr, nullptr,
+        CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+#endif
+
+    if (!timer) {
+        timer = CreateWaitableTimer(nullptr, FALSE, nullptr);
+    }
+
+    if (!timer) {
+        LOG(ERROR) << "Couldn't create idle timer.";
+        return;
+    }
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&next);
+
+    auto period = frequency.QuadPart * _bufferConfig.periodFrameSize /
+        _bufferConfig.sampleRate;
+    HANDLE handles[] = { _idleStopEvent, timer };
+
+    for (;;) {
+        LARGE_INTEGER dueTime;
+
+        next.QuadPart += period;
+        QueryPerformanceCounter(&now);
+
+        // Don't try to catch up after a long stall (e.g. system suspend).
+        if (now.QuadPart - next.QuadPart > period * 4) {
+            next = now;
+        }
+
+        // Relative due times are negative, in 100ns units.
+        dueTime.QuadPart = -max(next.QuadPart - now.QuadPart, 0LL) *
+            10000000 / frequency.QuadPart;
+        SetWaitableTimer(timer, &dueTime, 0, nullptr, nullptr, FALSE);
+
+        if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) !=
+            WAIT_OBJECT_0 + 1) {
+
+            break;
+        }
+
+        tick(bufferIndex);
+        bufferIndex ^= 1;
+    }
+
+    CloseHandle(timer);
+}
+
+bool SarClient::reconfigure(
+    const DriverConfig& driverConfig, const ConfigDiff& diff)
+{
+    if (diff.needsReset) {
+        return false;
+    }
+
+    // Stopped clients are replaced on the next start, which picks up the
+    // new config.
+    if (_device == INVALID_HANDLE_VALUE) {
+        return true;
+    }
+
+    if (_nextRegisterIndex + diff.addedEndpoints.size() >
+        SAR_MAX_ENDPOINT_COUNT) {
+
+        LOG(INFO) << "Out of endpoint registers, reset required.";
+        return false;
+    }
+
+    // New endpoints need their registers set up before the tick can see
+    // them, and removed ones must stop being ticked before the kernel drops
+    // them, so create, swap the routes, then remove.
+    std::vector<const EndpointConfig *> addedEndpoints;
+
+    for (auto& id : diff.addedEndpoints) {
+        auto endpoint = driverConfig.findEndpoint(id);
+
+        if (!endpoint) {
             return false;
         }
+
+        addedEndpoints.push_back(endpoint);
+    }
+
+    if (!createEndpoints(addedEndpoints)) {
+        return false;
+    }
+
+    auto routes = buildRoutes(driverConfig);
+    bool enableRouting = driverConfig.enableApplicationRouting &&
+        !_driverConfig.enableApplicationRouting;
+
+    {
+        std::lock_guard<std::mutex> registersLockGuard(_registersLock);
+        std::vector<bool> slotUsed(_bufferConfig.endpoints.size());
+
+        _routes = std::move(routes);
+        _driverConfig = driverConfig;
+
+        for (auto& route : _routes) {
+            if (route.asioSlot >= 0) {
+                slotUsed[route.asioSlot] = true;
+            }
+        }
+
+        // Channels of removed endpoints stay visible to the host until it
+        // resets, so leave them silent.
+        for (auto& swapBuffers : _bufferConfig.asioBuffers) {
+            for (size_t slot = 0; slot < slotUsed.size(); ++slot) {
+                if (slotUsed[slot]) {
+                    continue;
+                }
+
+                for (auto i = _bufferConfig.channelOffsets[slot];
+                     i < _bufferConfig.channelOffsets[slot + 1]; ++i) {
+
+                    if (swapBuffers[i]) {
+                        ZeroMemory(swapBuffers[i],
+                            _bufferConfig.periodFrameSize *
+                            _bufferConfig.sampleSize);
+                    }
+                }
+            }
+        }
+    }
+
+    for (auto& id : diff.removedEndpoints) {
+        auto it = _registerIndices.find(id);
+
+        if (it != _registerIndices.end()) {
+            removeEndpoint(it->second);
+            _registerIndices.erase(it);
+        }
     }
 
+    if (enableRouting && !enableRegistryFilter()) {
+        LOG(ERROR) << "Couldn't enable registry filter";
+    }
+
+    LOG(INFO) << "Reconfigured without reset: "
+        << diff.addedEndpoints.size() << " endpoints added, "
+        << diff.removedEndpoints.size() << " removed.";
     return true;
 }
 
@@ -469,6 +1116,11 @@ void SarClient::processNotificationHandleUpdates(int updateCount)
         DWORD endpointIndex = (DWORD)(response->associatedData >> 32);
         DWORD generation = (DWORD)(response->associatedData & 0xFFFFFFFF);
 
+        if (endpointIndex >= _notificationHandles.size()) {
+            CloseHandle((HANDLE)response->handle);
+            continue;
+        }
+
         if (_notificationHandles[endpointIndex].handle) {
             CloseHandle(_notificationHandles[endpointIndex].handle);
         }
@@ -478,6 +1130,292 @@ void SarClient::processNotificationHandleUpdates(int updateCount)
     }
 }
 
+void SarClient::publishClock()
+{
+    // Kernel readers of the presentation position spin while the sequence
+    // is odd, so only hold it odd for the stores that have to be seen
+    // together: the clock and the clock registers of the endpoints this
+    // tick advanced.
+    InterlockedIncrement((volatile LONG *)&_clockRegisters->sequence);
+    _clockRegisters->periodFrames = (DWORD)_clock.periodFrames();
+    _clockRegisters->tickCount = _clock.tickCount();
+    _clockRegisters->tickTime = _clock.tickTime();
+    _clockRegisters->nextTickTime = _clock.nextTickTime();
+    _clockRegisters->periodTime =
+        (ULONG64)(_clock.periodCounter() * 4294967296.0);
+    _clockRegisters->jitterRms =
+        (DWORD)(_clock.jitterRms() * _clock.frequency());
+    _clockRegisters->jitterMax =
+        (DWORD)(_clock.jitterMax() * _clock.frequency());
+
+    // The kernel zeroes the clock register when a stream stops, and writes
+    // the generation after it. Only advance from the value the tick read,
+    // and only if the stream is still the one it read, so a reset that lands
+    // mid-tick isn't overwritten with the old count.
+    for (auto& route : _routes) {
+        auto& regs = _registers[route.registerIndex];
+
+        if (route.clockAdvanced && regs.generation == route.clockGeneration) {
+            InterlockedCompareExchange(
+                (volatile LONG *)&regs.clockRegister,
+                (LONG)(route.clockBase + 1), (LONG)route.clockBase);
+        }
+    }
+
+    InterlockedIncrement((volatile LONG *)&_clockRegisters->sequence);
+}
+
+void SarClient::encodeEndpointChannel(
+    const float *src, void *first, size_t firstSize,
+    void *second, size_t secondSize, int channel, int channelCount,
+    DitherState *dither)
+{
+    auto sampleSize = _bufferConfig.sampleSize;
+    size_t stride = (size_t)(sampleSize * channelCount);
+    size_t firstFrames = firstSize / stride;
+
+    EncodeChannel((char *)first + sampleSize * channel, src,
+        firstFrames, stride, sampleSize, dither);
+    EncodeChannel((char *)second + sampleSize * channel,
+        src + firstFrames, secondSize / stride, stride, sampleSize, dither);
+}
+
+void SarClient::copyEndpointChannel(
+    void *planar, bool toEndpoint, void *first, size_t firstSize,
+    void *second, size_t secondSize, int channel, int channelCount)
+{
+    auto sampleSize = _bufferConfig.sampleSize;
+    size_t stride = (size_t)(sampleSize * channelCount);
+    size_t firstFrames = firstSize / stride;
+    char *parts[] = {
+        (char *)first + sampleSize * channel,
+        (char *)second + sampleSize * channel
+    };
+    size_t frames[] = { firstFrames, secondSize / stride };
+    auto planarPart = (char *)planar;
+
+    for (int i = 0; i < 2; ++i) {
+        if (toEndpoint) {
+            CopyChannel(parts[i], stride, planarPart, sampleSize,
+                frames[i], sampleSize);
+        } else {
+            CopyChannel(planarPart, sampleSize, parts[i], stride,
+                frames[i], sampleSize);
+        }
+
+        planarPart += frames[i] * sampleSize;
+    }
+}
+
+// Delays the endpoint data by swapping it through the route's delay line, so
+// each frame written out is the one that went in delayFrames earlier. Works
+// in runs bounded by the end of the ring part and the end of the line, so
+// any delay length and wrap position is handled without allocating.
+void SarClient::delayEndpoint(
+    EndpointRoute& route, void *first, size_t firstSize,
+    void *second, size_t secondSize, int channelCount, ULONG generation)
+{
+    size_t frameSize = (size_t)(_bufferConfig.sampleSize * channelCount);
+    char *parts[] = { (char *)first, (char *)second };
+    size_t sizes[] = { firstSize, secondSize };
+
+    if (!route.delayFrames || !frameSize) {
+        return;
+    }
+
+    if (route.delayChannels != channelCount ||
+        GENERATION_NUMBER(route.delayGeneration) !=
+        GENERATION_NUMBER(generation)) {
+
+        std::fill(route.delayLine.begin(), route.delayLine.end(), 0);
+        route.delayChannels = channelCount;
+        route.delayGeneration = generation;
+        route.delayPosition = 0;
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        auto data = parts[i];
+        auto remaining = sizes[i] / frameSize;
+
+        while (remaining) {
+            auto run = min(remaining,
+                (size_t)route.delayFrames - route.delayPosition);
+            auto line = route.delayLine.data() +
+                route.delayPosition * frameSize;
+
+            std::swap_ranges(data, data + run * frameSize, line);
+            data += run * frameSize;
+            remaining -= run;
+            route.delayPosition =
+                (route.delayPosition + run) % route.delayFrames;
+        }
+    }
+}
+
+// Convert a playback stream to the ASIO rate. Stream channel i goes to ASIO
+// channel i, so the channel mix doesn't apply.
+void SarClient::resamplePlayback(
+    EndpointRoute& route,
+    void *muxBufferFirst, size_t firstSize,
+    void *muxBufferSecond, size_t secondSize,
+    void **targetBuffers, int ntargets, int nsources)
+{
+    auto& resampler = route.resampler;
+    auto sampleSize = _bufferConfig.sampleSize;
+    size_t outputFrames = _bufferConfig.periodFrameSize;
+    size_t inputFrames = resampler.inputFramesFor(outputFrames);
+
+    for (int ch = 0; ch < nsources; ++ch) {
+        decodeEndpointChannel(resampler.input(ch),
+            muxBufferFirst, firstSize, muxBufferSecond, secondSize,
+            ch, nsources);
+    }
+
+    resampler.process(nsources, inputFrames, outputFrames);
+
+    for (int ti = 0; ti < ntargets; ++ti) {
+        if (!targetBuffers[ti]) {
+            continue;
+        }
+
+        if (ti < nsources) {
+            EncodeChannel(targetBuffers[ti], resampler.output(ti),
+                outputFrames, sampleSize, sampleSize, route.ditherFor(ti));
+        } else {
+            ZeroMemory(targetBuffers[ti], outputFrames * sampleSize);
+        }
+    }
+}
+
+// Mix returns are added at the ASIO rate, before conversion, since their
+// buses are filled from ASIO rate playback.
+void SarClient::resampleRecording(
+    EndpointRoute& route,
+    void *muxBufferFirst, size_t firstSize,
+    void *muxBufferSecond, size_t secondSize,
+    void **targetBuffers, int ntargets, int nsources)
+{
+    auto& resampler = route.resampler;
+    auto sampleSize = _bufferConfig.sampleSize;
+    size_t inputFrames = _bufferConfig.periodFrameSize;
+    size_t outputFrames = resampler.outputFramesFor(inputFrames);
+
+    for (int ch = 0; ch < nsources; ++ch) {
+        auto input = resampler.input(ch);
+
+        if (ch < ntargets && targetBuffers[ch]) {
+            DecodeChannel(input, targetBuffers[ch],
+                inputFrames, sampleSize, sampleSize);
+        } else {
+            std::fill(input, input + inputFrames, 0.0f);
+        }
+    }
+
+    for (auto& ret : route.returns) {
+        if (ret.active && ret.channel < nsources) {
+            MultiplyAccumulate(resampler.input(ret.channel),
+                ret.bus.data(), 1.0f, inputFrames);
+        }
+    }
+
+    resampler.process(nsources, inputFrames, outputFrames);
+
+    for (int ch = 0; ch < nsources; ++ch) {
+        encodeEndpointChannel(resampler.output(ch),
+            muxBufferFirst, firstSize, muxBufferSecond, secondSize,
+            ch, nsources, route.ditherFor(ch));
+    }
+}
+
+// Demux through a channel mix. Copy mixes shuffle samples as they are
+// deinterleaved; matrix mixes go through float so gains can be applied.
+void SarClient::demuxMixed(
+    EndpointRoute& route,
+    void *muxBufferFirst, size_t firstSize,
+    void *muxBufferSecond, size_t secondSize,
+    void **targetBuffers, int ntargets, int nsources)
+{
+    auto& mix = route.channelMix;
+    auto frames = _mixAccumulator.size();
+    auto targetSize = frames * _bufferConfig.sampleSize;
+
+    for (int ti = 0; ti < ntargets; ++ti) {
+        auto target = targetBuffers[ti];
+        auto count = ti < mix.outputs ? mix.termCounts[ti] : 0;
+
+        if (!target) {
+            continue;
+        }
+
+        if (!count) {
+            memset(target, 0, targetSize);
+        } else if (mix.kind == ChannelMix::Copy) {
+            copyEndpointChannel(target, false,
+                muxBufferFirst, firstSize, muxBufferSecond, secondSize,
+                mix.terms[ti][0].input, nsources);
+        } else {
+            std::fill(_mixAccumulator.begin(), _mixAccumulator.end(), 0.0f);
+
+            for (int term = 0; term < count; ++term) {
+                decodeEndpointChannel(_mixScratch.data(),
+                    muxBufferFirst, firstSize, muxBufferSecond, secondSize,
+                    mix.terms[ti][term].input, nsources);
+                MultiplyAccumulate(_mixAccumulator.data(), _mixScratch.data(),
+                    mix.terms[ti][term].gain, frames);
+            }
+
+            EncodeChannel(target, _mixAccumulator.data(), frames,
+                _bufferConfig.sampleSize, _bufferConfig.sampleSize,
+                route.ditherFor(ti));
+        }
+    }
+}
+
+void SarClient::muxMixed(
+    EndpointRoute& route,
+    void *muxBufferFirst, size_t firstSize,
+    void *muxBufferSecond, size_t secondSize,
+    void **targetBuffers, int ntargets, int nsources)
+{
+    auto& mix = route.channelMix;
+    auto frames = _mixAccumulator.size();
+
+    for (int si = 0; si < nsources; ++si) {
+        auto count = si < mix.outputs ? mix.termCounts[si] : 0;
+        auto input = count ? mix.terms[si][0].input : -1;
+
+        if (mix.kind == ChannelMix::Copy && count &&
+            input < ntargets && targetBuffers[input]) {
+
+            copyEndpointChannel(targetBuffers[input], true,
+                muxBufferFirst, firstSize, muxBufferSecond, secondSize,
+                si, nsources);
+            continue;
+        }
+
+        std::fill(_mixAccumulator.begin(), _mixAccumulator.end(), 0.0f);
+
+        for (int term = 0; term < count && mix.kind == ChannelMix::Matrix;
+             ++term) {
+
+            input = mix.terms[si][term].input;
+
+            if (input >= ntargets || !targetBuffers[input]) {
+                continue;
+            }
+
+            DecodeChannel(_mixScratch.data(), targetBuffers[input], frames,
+                _bufferConfig.sampleSize, _bufferConfig.sampleSize);
+            MultiplyAccumulate(_mixAccumulator.data(), _mixScratch.data(),
+                mix.terms[si][term].gain, frames);
+        }
+
+        encodeEndpointChannel(_mixAccumulator.data(),
+            muxBufferFirst, firstSize, muxBufferSecond, secondSize,
+            si, nsources, route.ditherFor(si));
+    }
+}
+
 void SarClient::demux(
     void *muxBufferFirst, size_t firstSize,
     void *muxBufferSecond, size_t secondSize,
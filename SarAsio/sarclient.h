@@ -18,7 +18,9 @@
 #define _SAR_ASIO_SARCLIENT_H
 
 #include "config.h"
+#include "dsp.h"
 #include "sar.h"
+#include "tickclock.h"
 
 namespace Sar {
 
@@ -28,7 +30,28 @@ struct BufferConfig
     int sampleRate;
     int sampleSize;
 
-    std::array<std::vector<std::vector<void *>>, 2> asioBuffers;
+    // The endpoints the ASIO channels were laid out for. Endpoints are
+    // matched to their slot by id, since the config may have changed since
+    // the host last reset the driver.
+    std::vector<EndpointConfig> endpoints;
+
+    // ASIO buffers of every slot's channels, flattened so the tick walks
+    // one array per buffer index: slot i owns entries channelOffsets[i] up
+    // to channelOffsets[i + 1]. Null where nothing backs a channel. There
+    // are two buffer indices, the ASIO swap halves, unless the wrapper
+    // splits each ASIO period into sub-ticks with one index apiece.
+    std::vector<size_t> channelOffsets;
+    std::vector<std::vector<void *>> asioBuffers;
+
+    // Lays the tables out for newEndpoints, with every buffer null.
+    void setEndpoints(
+        const std::vector<EndpointConfig>& newEndpoints,
+        int bufferCount = 2);
+
+    void *&buffer(int swapIndex, int slot, int channel)
+    {
+        return asioBuffers[swapIndex][channelOffsets[slot] + channel];
+    }
 };
 
 struct SarClient: public std::enable_shared_from_this<SarClient>
@@ -36,9 +59,22 @@ struct SarClient: public std::enable_shared_from_this<SarClient>
     SarClient(
         const DriverConfig& driverConfig,
         const BufferConfig& bufferConfig);
+    ~SarClient();
     void tick(long bufferIndex);
     bool start();
     void stop();
+
+    // Persistent mode: pause detaches the client from the host's ASIO
+    // buffers and keeps the endpoints running on silence, clocked by an idle
+    // thread. resume brings the endpoints up to date with driverConfig and
+    // reattaches to new buffers. It fails if their layout doesn't match the
+    // one the endpoints were created with, or if the config changed in a way
+    // that needs a reset.
+    void pause();
+    bool resume(
+        const DriverConfig& driverConfig, const BufferConfig& bufferConfig);
+    bool reconfigure(
+        const DriverConfig& driverConfig, const ConfigDiff& diff);
     void updateSampleRateOnTick()
     {
         _updateSampleRateOnTick = true;
@@ -59,9 +95,81 @@ private:
         HANDLE handle;
     };
 
+    // Mix matrix entries compiled against the route list. A send adds a
+    // playback endpoint channel into the bus of a recording route's return;
+    // the return then adds its bus into the recording endpoint.
+    struct MixSend
+    {
+        int channel;
+        size_t route;
+        size_t ret;
+        float gain;
+        std::vector<float> source; // this tick's channel, unless resampled
+    };
+
+    struct MixReturn
+    {
+        int channel;
+        std::vector<float> bus;
+        bool active; // a send contributed to bus this tick
+    };
+
+    // Where a SAR endpoint's audio goes on each tick. Playback routes come
+    // first so mix buses are complete before any recording route reads them.
+    struct EndpointRoute
+    {
+        EndpointType type;
+        int registerIndex;
+        int asioSlot; // index into BufferConfig::endpoints, or -1
+        bool clockAdvanced; // this tick, published with the clock
+        ULONG clockGeneration; // generation and clock register the tick read
+        DWORD clockBase;
+
+        // Constants of the slot, so the tick doesn't go through
+        // BufferConfig for them.
+        size_t asioOffset;
+        int asioChannelCount;
+        DWORD asioBufferSize;
+        std::vector<MixSend> sends;
+        std::vector<MixReturn> returns;
+
+        // How stream channels map to ASIO channels, rebuilt whenever the
+        // stream's channel count changes.
+        std::vector<int> channelMap;
+        bool standardMix;
+        int channelMixStreamChannels;
+        ChannelMix channelMix;
+
+        // Circular line of delayFrames whole frames, swapped with the
+        // endpoint data in place. Cleared when the stream's channel count,
+        // and so the frame layout, changes, and when a new stream replaces
+        // the one it was filled from.
+        int delayFrames;
+        int delayChannels;
+        ULONG delayGeneration;
+        size_t delayPosition;
+        std::vector<char> delayLine;
+
+        // Dither for float to integer conversions, by output channel: ASIO
+        // channel for playback, stream channel for recording.
+        bool dither;
+        std::array<DitherState, SAR_MAX_CHANNEL_COUNT> ditherStates;
+
+        // Conversion between the endpoint's own rate and the ASIO rate, when
+        // they differ: stream to ASIO for playback, ASIO to stream for
+        // recording. Stream channel i is carried by ASIO channel i.
+        bool resampled;
+        Resampler resampler;
+
+        DitherState *ditherFor(int channel)
+        {
+            return dither ? &ditherStates[channel] : nullptr;
+        }
+    };
+
     struct HandleQueueCompletion: OVERLAPPED
     {
-        SarHandleQueueResponse responses[32];
+        SarHandleQueueResponse responses[SAR_HANDLE_QUEUE_BATCH_SIZE];
     };
 
     struct ATL_NO_VTABLE NotificationClient:
@@ -102,10 +210,54 @@ private:
     bool openMmNotificationClient();
     bool setBufferLayout();
     bool createEndpoints();
+    bool createEndpoints(const std::vector<const EndpointConfig *>& endpoints);
+    bool removeEndpoint(int registerIndex);
+    std::vector<EndpointRoute> buildRoutes(const DriverConfig& driverConfig);
     bool enableRegistryFilter();
     void updateNotificationHandles();
     void processNotificationHandleUpdates(int updateCount);
+    void publishClock();
+    void idleLoop();
+    void stopIdleThread();
 
+    void decodeEndpointChannel(
+        float *dst, void *first, size_t firstSize,
+        void *second, size_t secondSize, int channel, int channelCount);
+    void accumulateEndpointChannel(
+        const float *src, void *first, size_t firstSize,
+        void *second, size_t secondSize, int channel, int channelCount,
+        DitherState *dither);
+    void encodeEndpointChannel(
+        const float *src, void *first, size_t firstSize,
+        void *second, size_t secondSize, int channel, int channelCount,
+        DitherState *dither);
+    void copyEndpointChannel(
+        void *planar, bool toEndpoint, void *first, size_t firstSize,
+        void *second, size_t secondSize, int channel, int channelCount);
+    void delayEndpoint(
+        EndpointRoute& route, void *first, size_t firstSize,
+        void *second, size_t secondSize, int channelCount,
+        ULONG generation);
+    void resamplePlayback(
+        EndpointRoute& route,
+        void *muxBufferFirst, size_t firstSize,
+        void *muxBufferSecond, size_t secondSize,
+        void **targetBuffers, int ntargets, int nsources);
+    void resampleRecording(
+        EndpointRoute& route,
+        void *muxBufferFirst, size_t firstSize,
+        void *muxBufferSecond, size_t secondSize,
+        void **targetBuffers, int ntargets, int nsources);
+    void demuxMixed(
+        EndpointRoute& route,
+        void *muxBufferFirst, size_t firstSize,
+        void *muxBufferSecond, size_t secondSize,
+        void **targetBuffers, int ntargets, int nsources);
+    void muxMixed(
+        EndpointRoute& route,
+        void *muxBufferFirst, size_t firstSize,
+        void *muxBufferSecond, size_t secondSize,
+        void **targetBuffers, int ntargets, int nsources);
     void demux(
         void *muxBufferFirst, size_t firstSize,
         void *muxBufferSecond, size_t secondSize,
@@ -119,12 +271,20 @@ private:
 
     DriverConfig _driverConfig;
     BufferConfig _bufferConfig;
-    std::vector<NotificationHandle> _notificationHandles;
+    std::vector<EndpointRoute> _routes;
+    std::unordered_map<std::string, int> _registerIndices;
+    int _nextRegisterIndex = 0;
+    std::vector<float> _mixScratch;
+    std::vector<float> _mixAccumulator;
+    std::vector<NotificationHandle> _notificationHandles; // by register index
     HANDLE _device;
     HANDLE _completionPort;
     void *_sharedBuffer;
     DWORD _sharedBufferSize;
     volatile SarEndpointRegisters *_registers;
+    volatile SarClockRegisters *_clockRegisters;
+    TickClock _clock;
+    LONGLONG _startCounter = 0; // cleared by the first tick after start
     HandleQueueCompletion _handleQueueCompletion;
     bool _handleQueueStarted;
     CComPtr<IMMDeviceEnumerator> _mmEnumerator;
@@ -132,6 +292,8 @@ private:
     bool _mmNotificationClientRegistered = false;
     std::atomic<bool> _updateSampleRateOnTick = false;
     std::mutex _registersLock;
+    std::thread _idleThread;
+    HANDLE _idleStopEvent = nullptr;
 };
 
 } // namespace Sar
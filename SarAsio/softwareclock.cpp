@@ -0,0 +1,370 @@
+// SynchronousAudioRouter
+// Copyright (C) 2015 Mackenzie Straight
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SynchronousAudioRouter.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "stdafx.h"
+#include <avrt.h>
+#include "sar.h"
+#include "softwareclock.h"
+#include "utility.h"
+
+#pragma comment(lib, "avrt.lib")
+
+namespace Sar {
+
+void SoftwareClockDriver::FinalRelease()
+{
+    stop();
+
+    if (_stopEvent) {
+        CloseHandle(_stopEvent);
+        _stopEvent = nullptr;
+    }
+}
+
+AsioBool SoftwareClockDriver::init(void *sysHandle)
+{
+    LOG(INFO) << "SoftwareClockDriver::init";
+    auto config = DriverConfig::fromFile(ConfigurationPath(L"default.json"));
+
+    UNREFERENCED_PARAMETER(sysHandle);
+    _sampleRate = config.softwareClockSampleRate;
+    _bufferSize = config.softwareClockBufferSize;
+
+    if (!_stopEvent) {
+        _stopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    }
+
+    return _stopEvent ? AsioBool::True : AsioBool::False;
+}
+
+void SoftwareClockDriver::getDriverName(char name[32])
+{
+    strcpy_s(name, 32, SAR_SOFTWARE_CLOCK_NAME);
+}
+
+long SoftwareClockDriver::getDriverVersion()
+{
+    return 1;
+}
+
+void SoftwareClockDriver::getErrorMessage(char str[124])
+{
+    strcpy_s(str, 124, "");
+}
+
+AsioStatus SoftwareClockDriver::start()
+{
+    LOG(INFO) << "SoftwareClockDriver::start";
+
+    if (!_callbacks) {
+        return AsioStatus::InvalidMode;
+    }
+
+    if (_thread.joinable()) {
+        return AsioStatus::OK;
+    }
+
+    ResetEvent(_stopEvent);
+
+    {
+        std::lock_guard<std::mutex> positionLockGuard(_positionLock);
+        _samplePosition = 0;
+        _sampleTimestamp = 0;
+    }
+
+    _thread = std::thread(&SoftwareClockDriver::clockLoop, this);
+    return AsioStatus::OK;
+}
+
+AsioStatus SoftwareClockDriver::stop()
+{
+    LOG(INFO) << "SoftwareClockDriver::stop";
+
+    if (_thread.joinable()) {
+        SetEvent(_stopEvent);
+        _thread.join();
+    }
+
+    return AsioStatus::OK;
+}
+
+AsioStatus SoftwareClockDriver::getChannels(
+    long *inputCount, long *outputCount)
+{
+    *inputCount = *outputCount = 0;
+    return AsioStatus::OK;
+}
+
+AsioStatus SoftwareClockDriver::getLatencies(
+    long *inputLatency, long *outputLatency)
+{
+    *inputLatency = *outputLatency =
+        _activeBufferSize ? _activeBufferSize : _bufferSize;
+    return AsioStatus::OK;
+}
+
+AsioStatus SoftwareClockDriver::getBufferSize(
+    long *minSize, long *maxSize, long *preferredSize, long *granularity)
+{
+    *minSize = *maxSize = *preferredSize = _bufferSize;
+    *granularity = 0;
+    return AsioStatus::OK;
+}
+
+AsioStatus SoftwareClockDriver::canSampleRate(double sampleRate)
+{
+    if (sampleRate < SAR_MIN_SAMPLE_RATE || sampleRate > SAR_MAX_SAMPLE_RATE) {
+        return AsioStatus::NoClock;
+    }
+
+    return AsioStatus::OK;
+}
+
+AsioStatus SoftwareClockDriver::getSampleRate(double *sampleRate)
+{
+    *sampleRate = _sampleRate;
+    return AsioStatus::OK;
+}
+
+AsioStatus SoftwareClockDriver::setSampleRate(double sampleRate)
+{
+    LOG(INFO) << "SoftwareClockDriver::setSampleRate " << sampleRate;
+
+    if (canSampleRate(sampleRate) != AsioStatus::OK) {
+        return AsioStatus::NoClock;
+    }
+
+    if (_thread.joinable() && (int)sampleRate != _sampleRate) {
+        return AsioStatus::InvalidMode;
+    }
+
+    _sampleRate = (int)sampleRate;
+    return AsioStatus::OK;
+}
+
+AsioStatus SoftwareClockDriver::getClockSources(
+    AsioClockSource *clocks, long *count)
+{
+    if (*count < 1) {
+        return AsioStatus::InvalidParameter;
+    }
+
+    clocks->index = 0;
+    clocks->channel = -1;
+    clocks->group = -1;
+    clocks->isCurrentSource = AsioBool::True;
+    strcpy_s(clocks->name, 32, "Internal");
+    *count = 1;
+    return AsioStatus::OK;
+}
+
+AsioStatus SoftwareClockDriver::setClockSource(long index)
+{
+    return index == 0 ? AsioStatus::OK : AsioStatus::InvalidParameter;
+}
+
+AsioStatus SoftwareClockDriver::getSamplePosition(
+    int64_t *pos, int64_t *timestamp)
+{
+    if (!_thread.joinable()) {
+        return AsioStatus::SPNotAdvancing;
+    }
+
+    std::lock_guard<std::mutex> positionLockGuard(_positionLock);
+    *pos = _samplePosition;
+    *timestamp = _sampleTimestamp;
+    return AsioStatus::OK;
+}
+
+AsioStatus SoftwareClockDriver::getChannelInfo(AsioChannelInfo *info)
+{
+    UNREFERENCED_PARAMETER(info);
+    return AsioStatus::NotPresent;
+}
+
+AsioStatus SoftwareClockDriver::createBuffers(
+    AsioBufferInfo *infos, long channelCount, long bufferSize,
+    AsioCallbacks *callbacks)
+{
+    LOG(INFO) << "SoftwareClockDriver::createBuffers(" << channelCount
+        << ", " << bufferSize << ")";
+    UNREFERENCED_PARAMETER(infos);
+
+    if (channelCount) {
+        return AsioStatus::InvalidParameter;
+    }
+
+    if (bufferSize <= 0 || !callbacks) {
+        return AsioStatus::InvalidMode;
+    }
+
+    _activeBufferSize = bufferSize;
+    _callbacks = callbacks;
+    _timeInfo = callbacks->tickWithTime && callbacks->asioMessage &&
+        callbacks->asioMessage(
+            AsioMessage::SupportsTimeInfo, 0, nullptr, nullptr);
+    return AsioStatus::OK;
+}
+
+AsioStatus SoftwareClockDriver::disposeBuffers()
+{
+    LOG(INFO) << "SoftwareClockDriver::disposeBuffers";
+    stop();
+    _activeBufferSize = 0;
+    _callbacks = nullptr;
+    _timeInfo = false;
+    return AsioStatus::OK;
+}
+
+AsioStatus SoftwareClockDriver::controlPanel()
+{
+    return AsioStatus::NotPresent;
+}
+
+AsioStatus SoftwareClockDriver::future(long selector, void *opt)
+{
+    UNREFERENCED_PARAMETER(selector);
+    UNREFERENCED_PARAMETER(opt);
+    return AsioStatus::NotPresent;
+}
+
+AsioStatus SoftwareClockDriver::outputReady()
+{
+    return AsioStatus::NotPresent;
+}
+
+// Sleeps on a high resolution timer to each period's deadline, kept in
+// fractional counter units so rounding doesn't drift the rate, then runs
+// the host's buffer switch in an MMCSS Pro Audio thread.
+void SoftwareClockDriver::clockLoop()
+{
+    HANDLE timer = nullptr;
+    DWORD taskIndex = 0;
+    LARGE_INTEGER frequency, now;
+    long bufferIndex = 0;
+    uint64_t ticks = 0;
+    double lateSquares = 0, lateMax = 0;
+    auto mmcss = AvSetMmThreadCharacteristics(TEXT("Pro Audio"), &taskIndex);
+
+    if (mmcss) {
+        AvSetMmThreadPriority(mmcss, AVRT_PRIORITY_CRITICAL);
+    } else {
+        LOG(WARNING) << "Couldn't join MMCSS, error " << GetLastError()
+            << ", using time critical priority.";
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+    }
+
+#ifdef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+    timer = CreateWaitableTimerEx(nullptr, nullptr,
+        CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+#endif
+
+    if (!timer) {
+        timer = CreateWaitableTimer(nullptr, FALSE, nullptr);
+    }
+
+    if (!timer) {
+        LOG(ERROR) << "Couldn't create software clock timer.";
+
+        if (mmcss) {
+            AvRevertMmThreadCharacteristics(mmcss);
+        }
+
+        return;
+    }
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+
+    double period =
+        (double)frequency.QuadPart * _activeBufferSize / _sampleRate;
+    double deadline = (double)now.QuadPart;
+    HANDLE handles[] = { _stopEvent, timer };
+
+    LOG(INFO) << "Software clock running at " << _sampleRate << " Hz, "
+        << _activeBufferSize << " frames per period.";
+
+    for (;;) {
+        LARGE_INTEGER dueTime;
+
+        deadline += period;
+        QueryPerformanceCounter(&now);
+
+        // Don't try to catch up after a long stall (e.g. system suspend).
+        if (now.QuadPart - deadline > period * 4) {
+            deadline = (double)now.QuadPart;
+        }
+
+        // Relative due times are negative, in 100ns units.
+        dueTime.QuadPart = -(LONGLONG)(
+            max(deadline - now.QuadPart, 0.0) * 10000000 / frequency.QuadPart);
+        SetWaitableTimer(timer, &dueTime, 0, nullptr, nullptr, FALSE);
+
+        if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) !=
+            WAIT_OBJECT_0 + 1) {
+
+            break;
+        }
+
+        QueryPerformanceCounter(&now);
+
+        double late = (now.QuadPart - deadline) / frequency.QuadPart;
+        auto timestamp = (int64_t)(
+            (double)now.QuadPart * 1000000000.0 / frequency.QuadPart);
+        auto position = (int64_t)(ticks * _activeBufferSize);
+
+        lateSquares += late * late;
+        lateMax = max(lateMax, fabs(late));
+
+        {
+            std::lock_guard<std::mutex> positionLockGuard(_positionLock);
+            _samplePosition = position;
+            _sampleTimestamp = timestamp;
+        }
+
+        if (_timeInfo) {
+            AsioTime time = {};
+
+            time.timeInfo.speed = 1.0;
+            time.timeInfo.systemTime = timestamp;
+            time.timeInfo.samplePosition = position;
+            time.timeInfo.sampleRate = _sampleRate;
+            time.timeInfo.flags = AsioSystemTimeValid |
+                AsioSamplePositionValid | AsioSampleRateValid |
+                AsioSpeedValid;
+            _callbacks->tickWithTime(&time, bufferIndex, AsioBool::True);
+        } else {
+            _callbacks->tick(bufferIndex, AsioBool::True);
+        }
+
+        bufferIndex ^= 1;
+        ticks++;
+    }
+
+    if (ticks) {
+        LOG(INFO) << "Software clock: " << ticks << " ticks, woke late by "
+            << sqrt(lateSquares / ticks) * 1e6 << " us rms, "
+            << lateMax * 1e6 << " us max";
+    }
+
+    CloseHandle(timer);
+
+    if (mmcss) {
+        AvRevertMmThreadCharacteristics(mmcss);
+    }
+}
+
+} // namespace Sar
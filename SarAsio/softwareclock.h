@@ -0,0 +1,93 @@
+// SynchronousAudioRouter
+// Copyright (C) 2015 Mackenzie Straight
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SynchronousAudioRouter.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _SAR_ASIO_SOFTWARECLOCK_H
+#define _SAR_ASIO_SOFTWARECLOCK_H
+
+#include "config.h"
+#include "tinyasio.h"
+
+namespace Sar {
+
+// Listed with the installed drivers but never registered with COM.
+#define SAR_SOFTWARE_CLOCK_CLSID "{8F3A6C21-5B7E-4D92-A1C4-3E6F0B9D7A58}"
+#define SAR_SOFTWARE_CLOCK_NAME "SAR Software Clock"
+
+// An ASIO driver with no channels of its own that ticks from a timer thread
+// at the configured rate and buffer size. Selected in place of a hardware
+// interface, it lets SAR run its virtual endpoints on machines without one.
+struct ATL_NO_VTABLE SoftwareClockDriver:
+    public CComObjectRootEx<CComMultiThreadModel>,
+    public IASIO
+{
+    BEGIN_COM_MAP(SoftwareClockDriver)
+        COM_INTERFACE_ENTRY(IASIO)
+    END_COM_MAP()
+
+    DECLARE_NO_REGISTRY()
+
+    void FinalRelease();
+
+    virtual AsioBool init(void *sysHandle) override;
+    virtual void getDriverName(char name[32]) override;
+    virtual long getDriverVersion() override;
+    virtual void getErrorMessage(char str[124]) override;
+    virtual AsioStatus start() override;
+    virtual AsioStatus stop() override;
+    virtual AsioStatus getChannels(
+        long *inputCount, long *outputCount) override;
+    virtual AsioStatus getLatencies(
+        long *inputLatency, long *outputLatency) override;
+    virtual AsioStatus getBufferSize(
+        long *minSize, long *maxSize,
+        long *preferredSize, long *granularity) override;
+    virtual AsioStatus canSampleRate(double sampleRate) override;
+    virtual AsioStatus getSampleRate(double *sampleRate) override;
+    virtual AsioStatus setSampleRate(double sampleRate) override;
+    virtual AsioStatus getClockSources(
+        AsioClockSource *clocks, long *count) override;
+    virtual AsioStatus setClockSource(long index) override;
+    virtual AsioStatus getSamplePosition(
+        int64_t *pos, int64_t *timestamp) override;
+    virtual AsioStatus getChannelInfo(AsioChannelInfo *info) override;
+    virtual AsioStatus createBuffers(
+        AsioBufferInfo *infos, long channelCount, long bufferSize,
+        AsioCallbacks *callbacks) override;
+    virtual AsioStatus disposeBuffers() override;
+    virtual AsioStatus controlPanel() override;
+    virtual AsioStatus future(long selector, void *opt) override;
+    virtual AsioStatus outputReady() override;
+
+private:
+    void clockLoop();
+
+    int _sampleRate = 48000;
+    int _bufferSize = 256;
+    long _activeBufferSize = 0; // 0 until createBuffers
+    AsioCallbacks *_callbacks = nullptr;
+    bool _timeInfo = false;
+    std::thread _thread;
+    HANDLE _stopEvent = nullptr;
+
+    // Written by the clock thread; the timestamp is in nanoseconds.
+    std::mutex _positionLock;
+    int64_t _samplePosition = 0;
+    int64_t _sampleTimestamp = 0;
+};
+
+} // namespace Sar
+
+#endif // _SAR_ASIO_SOFTWARECLOCK_H
@@ -36,7 +36,9 @@
 #include <atlcom.h>
 #include <atlstr.h>
 
+#include <algorithm>
 #include <atomic>
+#include <cmath>
 #include <codecvt>
 #include <cstddef>
 #include <cstdint>
@@ -49,6 +51,7 @@
 #include <unordered_map>
 #include <array>
 #include <mutex>
+#include <thread>
 
 #include "resource.h"
 
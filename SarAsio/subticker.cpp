@@ -0,0 +1,201 @@
+// SynchronousAudioRouter
+// Copyright (C) 2015 Mackenzie Straight
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SynchronousAudioRouter.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "stdafx.h"
+#include <avrt.h>
+#include "subticker.h"
+
+namespace Sar {
+
+SubTicker::~SubTicker()
+{
+    stop();
+}
+
+bool SubTicker::start(
+    std::shared_ptr<SarClient> client, int subTicks,
+    int subTickFrames, int sampleRate)
+{
+    LARGE_INTEGER frequency;
+
+    stop();
+    QueryPerformanceFrequency(&frequency);
+    _wakeEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    _stopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+
+    if (!_wakeEvent || !_stopEvent) {
+        LOG(ERROR) << "Couldn't create sub-tick events.";
+        stop();
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lockGuard(_lock);
+        _client = client;
+        _subTicks = subTicks;
+        _subTickPeriod =
+            (double)frequency.QuadPart * subTickFrames / sampleRate;
+        _done = subTicks; // nothing outstanding before the first switch
+    }
+
+    _thread = std::thread(&SubTicker::timerLoop, this);
+    LOG(INFO) << "Sub-ticking " << subTicks << " times per ASIO period of "
+        << subTicks * subTickFrames << " frames.";
+    return true;
+}
+
+void SubTicker::stop()
+{
+    if (_thread.joinable()) {
+        SetEvent(_stopEvent);
+        _thread.join();
+    }
+
+    if (_wakeEvent) {
+        CloseHandle(_wakeEvent);
+        _wakeEvent = nullptr;
+    }
+
+    if (_stopEvent) {
+        CloseHandle(_stopEvent);
+        _stopEvent = nullptr;
+    }
+
+    std::lock_guard<std::mutex> lockGuard(_lock);
+    _client = nullptr;
+}
+
+void SubTicker::finishPeriod()
+{
+    std::lock_guard<std::mutex> lockGuard(_lock);
+
+    if (!_client) {
+        return;
+    }
+
+    while (_done < _subTicks) {
+        _client->tick(_bufferIndex * _subTicks + _done++);
+    }
+}
+
+void SubTicker::beginPeriod(long bufferIndex)
+{
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter(&now);
+
+    {
+        std::lock_guard<std::mutex> lockGuard(_lock);
+
+        if (!_client) {
+            return;
+        }
+
+        _bufferIndex = bufferIndex;
+        _periodStart = now.QuadPart;
+        _done = 0;
+        _client->tick(_bufferIndex * _subTicks + _done++);
+    }
+
+    SetEvent(_wakeEvent);
+}
+
+// Waits for each outstanding sub-tick's due time, or for a buffer switch to
+// start a new period, whichever comes first.
+void SubTicker::timerLoop()
+{
+    HANDLE timer = nullptr;
+    DWORD taskIndex = 0;
+    LARGE_INTEGER frequency;
+    auto mmcss = AvSetMmThreadCharacteristics(TEXT("Pro Audio"), &taskIndex);
+
+    if (!mmcss) {
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+    }
+
+#ifdef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+    timer = CreateWaitableTimerEx(nullptr, nullptr,
+        CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+#endif
+
+    if (!timer) {
+        timer = CreateWaitableTimer(nullptr, FALSE, nullptr);
+    }
+
+    if (!timer) {
+        LOG(ERROR) << "Couldn't create sub-tick timer.";
+
+        if (mmcss) {
+            AvRevertMmThreadCharacteristics(mmcss);
+        }
+
+        return;
+    }
+
+    QueryPerformanceFrequency(&frequency);
+
+    HANDLE handles[] = { _stopEvent, _wakeEvent, timer };
+
+    for (;;) {
+        LARGE_INTEGER now, dueTime;
+        double due;
+        bool pending;
+        DWORD waitResult;
+
+        {
+            std::lock_guard<std::mutex> lockGuard(_lock);
+            pending = _done < _subTicks;
+            due = _periodStart + _done * _subTickPeriod;
+        }
+
+        if (pending) {
+            QueryPerformanceCounter(&now);
+
+            // Relative due times are negative, in 100ns units.
+            dueTime.QuadPart = -(LONGLONG)(
+                max(due - now.QuadPart, 0.0) * 10000000 / frequency.QuadPart);
+            SetWaitableTimer(timer, &dueTime, 0, nullptr, nullptr, FALSE);
+        } else {
+            CancelWaitableTimer(timer);
+        }
+
+        waitResult = WaitForMultipleObjects(
+            pending ? 3 : 2, handles, FALSE, INFINITE);
+
+        if (waitResult == WAIT_OBJECT_0 + 1) {
+            continue;
+        } else if (waitResult != WAIT_OBJECT_0 + 2) {
+            break;
+        }
+
+        std::lock_guard<std::mutex> lockGuard(_lock);
+        QueryPerformanceCounter(&now);
+
+        while (_client && _done < _subTicks &&
+               now.QuadPart >= _periodStart + _done * _subTickPeriod) {
+
+            _client->tick(_bufferIndex * _subTicks + _done++);
+        }
+    }
+
+    CloseHandle(timer);
+
+    if (mmcss) {
+        AvRevertMmThreadCharacteristics(mmcss);
+    }
+}
+
+} // namespace Sar
@@ -0,0 +1,67 @@
+// SynchronousAudioRouter
+// Copyright (C) 2015 Mackenzie Straight
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SynchronousAudioRouter.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _SAR_ASIO_SUBTICKER_H
+#define _SAR_ASIO_SUBTICKER_H
+
+#include "sarclient.h"
+
+namespace Sar {
+
+// ASIO buffers shorter than this many frames per sub-tick are refused.
+#define SAR_MIN_SUB_TICK_FRAMES 16
+
+// Runs a SarClient at a fraction of the ASIO period, for ASIO buffers longer
+// than the audio engine's. Each buffer switch starts a period of subTicks
+// client ticks: the first runs from the switch itself and a timer thread
+// paces the rest across the period, so WaveRT clients are notified at engine
+// sized intervals. Sub-tick i of the period started by buffer index b uses
+// client buffer index b * subTicks + i.
+struct SubTicker
+{
+    ~SubTicker();
+    bool start(
+        std::shared_ptr<SarClient> client, int subTicks,
+        int subTickFrames, int sampleRate);
+    void stop();
+
+    // Runs the sub-ticks of the last period that are still outstanding, so
+    // the buffers the host is about to read are complete. Call before the
+    // host's buffer switch.
+    void finishPeriod();
+
+    // Starts the period of bufferIndex. Call after the host's buffer switch
+    // so its outputs are there to be read.
+    void beginPeriod(long bufferIndex);
+
+private:
+    void timerLoop();
+
+    std::shared_ptr<SarClient> _client;
+    int _subTicks = 1;
+    double _subTickPeriod = 0; // in performance counter units
+    std::mutex _lock;
+    long _bufferIndex = 0;
+    int _done = 0; // sub-ticks of the current period run so far
+    LONGLONG _periodStart = 0;
+    std::thread _thread;
+    HANDLE _wakeEvent = nullptr;
+    HANDLE _stopEvent = nullptr;
+};
+
+} // namespace Sar
+
+#endif // _SAR_ASIO_SUBTICKER_H
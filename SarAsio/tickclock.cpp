@@ -0,0 +1,86 @@
+// SynchronousAudioRouter
+// Copyright (C) 2015 Mackenzie Straight
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SynchronousAudioRouter.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "stdafx.h"
+#include "tickclock.h"
+
+namespace Sar {
+
+// Loop bandwidth in Hz. Low enough to reject per-tick scheduling noise, high
+// enough to follow the drift of a real audio clock within a few seconds.
+static const double kLoopBandwidth = 1.0;
+static const double kTwoPi = 6.283185307179586;
+
+// A tick this many periods away from the prediction means the stream stalled
+// or skipped (driver reset, xrun), so the loop restarts instead of slewing.
+static const double kResyncPeriods = 4.0;
+
+// Weight of the newest sample in the running jitter average.
+static const double kJitterWeight = 1.0 / 256;
+
+void TickClock::reset(int periodFrames, int sampleRate, LONGLONG frequency)
+{
+    double omega;
+
+    _periodFrames = periodFrames;
+    _frequency = (double)frequency;
+    _nominalPeriod = (double)periodFrames / sampleRate;
+    omega = kTwoPi * kLoopBandwidth * _nominalPeriod;
+    _b = sqrt(2.0) * omega;
+    _c = omega * omega;
+    _e2 = _nominalPeriod;
+    _t0 = _t1 = 0;
+    _jitterSquares = _jitterMax = 0;
+    _tickCount = 0;
+}
+
+void TickClock::restart(LONGLONG now)
+{
+    _origin = now;
+    _t0 = 0;
+    _t1 = _e2;
+}
+
+void TickClock::tick(LONGLONG now)
+{
+    if (!_tickCount++) {
+        restart(now);
+        return;
+    }
+
+    double t = (now - _origin) / _frequency;
+    double e = t - _t1;
+
+    if (fabs(e) > kResyncPeriods * _e2) {
+        // Keep the period estimate, only the phase is lost.
+        restart(now);
+        return;
+    }
+
+    _t0 = _t1;
+    _t1 += _b * e + _e2;
+    _e2 += _c * e;
+
+    // Guard against the loop running away on a pathological trace.
+    if (_e2 < _nominalPeriod / 2 || _e2 > _nominalPeriod * 2) {
+        _e2 = _nominalPeriod;
+    }
+
+    _jitterSquares += (e * e - _jitterSquares) * kJitterWeight;
+    _jitterMax = max(_jitterMax, fabs(e));
+}
+
+} // namespace Sar
@@ -0,0 +1,72 @@
+// SynchronousAudioRouter
+// Copyright (C) 2015 Mackenzie Straight
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SynchronousAudioRouter.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _SAR_ASIO_TICKCLOCK_H
+#define _SAR_ASIO_TICKCLOCK_H
+
+namespace Sar {
+
+// Second order delay-locked loop tracking the ASIO tick timeline. Raw tick
+// times carry whatever scheduling jitter the inner driver has; the loop
+// filters that out and yields a smoothed period, the smoothed time of the
+// current tick and a prediction for the next one. Times are kept in seconds
+// relative to the first tick and converted back to performance counter units
+// on the way out.
+struct TickClock
+{
+    void reset(int periodFrames, int sampleRate, LONGLONG frequency);
+    void tick(LONGLONG now);
+
+    uint64_t tickCount() const { return _tickCount; }
+    LONGLONG tickTime() const { return toCounter(_t0); }
+    LONGLONG nextTickTime() const { return toCounter(_t1); }
+    int periodFrames() const { return _periodFrames; }
+    double frequency() const { return _frequency; }
+
+    // Smoothed period, in seconds and in performance counter units.
+    double period() const { return _e2; }
+    double periodCounter() const { return _e2 * _frequency; }
+    double sampleRate() const { return _periodFrames / _e2; }
+
+    // Deviation of the raw tick times from the loop, in seconds.
+    double jitterRms() const { return sqrt(_jitterSquares); }
+    double jitterMax() const { return _jitterMax; }
+
+private:
+    LONGLONG toCounter(double t) const
+    {
+        return _origin + (LONGLONG)(t * _frequency);
+    }
+
+    void restart(LONGLONG now);
+
+    double _frequency = 1;
+    double _nominalPeriod = 0;
+    double _b = 0;
+    double _c = 0;
+    double _t0 = 0;
+    double _t1 = 0;
+    double _e2 = 0;
+    double _jitterSquares = 0;
+    double _jitterMax = 0;
+    LONGLONG _origin = 0;
+    uint64_t _tickCount = 0;
+    int _periodFrames = 0;
+};
+
+} // namespace Sar
+
+#endif // _SAR_ASIO_TICKCLOCK_H
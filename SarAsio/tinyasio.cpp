@@ -15,6 +15,7 @@
 // along with SynchronousAudioRouter.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "stdafx.h"
+#include "softwareclock.h"
 #include "tinyasio.h"
 #include "utility.h"
 
@@ -34,6 +35,8 @@ std::vector<AsioDriver> InstalledAsioDrivers()
         HKEY_LOCAL_MACHINE, TEXT("SOFTWARE\\ASIO"), 0, KEY_READ, &asio))) {
 
         LOG(INFO) << "Failed to open HKLM\\SOFTWARE\\ASIO: status " << err;
+        result.emplace_back(AsioDriver{
+            SAR_SOFTWARE_CLOCK_NAME, SAR_SOFTWARE_CLOCK_CLSID });
         return result;
     }
 
@@ -80,6 +83,10 @@ std::vector<AsioDriver> InstalledAsioDrivers()
     LOG(INFO) << "Done querying ASIO drivers. Status: " << err;
 
     RegCloseKey(asio);
+
+    // Always available, for machines without audio hardware.
+    result.emplace_back(AsioDriver{
+        SAR_SOFTWARE_CLOCK_NAME, SAR_SOFTWARE_CLOCK_CLSID });
     return result;
 }
 
@@ -89,6 +96,18 @@ HRESULT AsioDriver::open(IASIO **ppAsio)
     auto wstr = UTF8ToWide(clsid);
     GUID clsid;
 
+    if (this->clsid == SAR_SOFTWARE_CLOCK_CLSID) {
+        CComObject<SoftwareClockDriver> *driver;
+
+        status = CComObject<SoftwareClockDriver>::CreateInstance(&driver);
+
+        if (!SUCCEEDED(status)) {
+            return status;
+        }
+
+        return driver->QueryInterface(ppAsio);
+    }
+
     status = CLSIDFromString(wstr.c_str(), &clsid);
 
     if (!SUCCEEDED(status)) {
@@ -114,6 +114,15 @@ struct AsioTimeCode
     char future[64];
 };
 
+// AsioTimeInfo::flags
+enum : unsigned
+{
+    AsioSystemTimeValid = 1,
+    AsioSamplePositionValid = 2,
+    AsioSampleRateValid = 4,
+    AsioSpeedValid = 8
+};
+
 struct AsioTimeInfo
 {
     double speed;
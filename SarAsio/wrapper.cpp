@@ -18,6 +18,7 @@
 #include <initguid.h>
 #include "configui.h"
 #include "dllmain.h"
+#include "softwareclock.h"
 #include "tinyasio.h"
 #include "wrapper.h"
 #include "utility.h"
@@ -28,6 +29,102 @@ SarAsioWrapper *gActiveWrapper;
 
 static const char kNoInterfaceSelected[] = "No Interface Selected";
 
+// In ASIO frames. Converted endpoints count their delay at their own rate,
+// plus the resampler's lag in its input frames.
+static long maxDelayFrames(
+    const DriverConfig& config, EndpointType type, double sampleRate)
+{
+    long result = 0;
+
+    for (auto& endpoint : config.endpoints) {
+        if (endpoint.type != type || endpoint.attachPhysical) {
+            continue;
+        }
+
+        double frames = endpoint.delayFrames;
+
+        if (sampleRate > 0 && endpoint.sampleRate &&
+            endpoint.sampleRate != (int)sampleRate) {
+            double scale = sampleRate / endpoint.sampleRate;
+
+            frames = type == EndpointType::Playback ?
+                (frames + SAR_RESAMPLER_TAPS / 2) * scale :
+                frames * scale + SAR_RESAMPLER_TAPS / 2;
+        }
+
+        result = max(result, (long)ceil(frames));
+    }
+
+    return result;
+}
+
+// The audio engine's periodicity is always 10ms unless overriden by the
+// audio driver, which we don't do. Buffers longer than that would starve
+// the engine between ASIO ticks, so they're split into as few equal
+// sub-ticks as fit in an engine period. Returns 0 for buffer sizes that
+// can't be split into sub-ticks of at least SAR_MIN_SUB_TICK_FRAMES.
+static int subTickCount(long bufferFrameSize, double sampleRate)
+{
+    long enginePeriod = max(1L, (long)(sampleRate / 100.0));
+
+    if (bufferFrameSize <= enginePeriod) {
+        return 1;
+    }
+
+    for (long subTicks = (bufferFrameSize + enginePeriod - 1) / enginePeriod;
+         bufferFrameSize / subTicks >= SAR_MIN_SUB_TICK_FRAMES; ++subTicks) {
+
+        if (bufferFrameSize % subTicks == 0) {
+            return (int)subTicks;
+        }
+    }
+
+    return 0;
+}
+
+template<typename T>
+static void mixSaturated(T *dst, const T *src, long frames, T lo, T hi)
+{
+    for (long i = 0; i < frames; ++i) {
+        int64_t sum = (int64_t)dst[i] + src[i];
+
+        dst[i] = (T)(sum < lo ? lo : sum > hi ? hi : sum);
+    }
+}
+
+static void mixSamples(void *dst, const void *src, long frames, int sampleSize)
+{
+    switch (sampleSize) {
+    case 2:
+        mixSaturated((int16_t *)dst, (const int16_t *)src, frames,
+            (int16_t)INT16_MIN, (int16_t)INT16_MAX);
+        break;
+
+    case 4:
+        mixSaturated((int32_t *)dst, (const int32_t *)src, frames,
+            (int32_t)INT32_MIN, (int32_t)INT32_MAX);
+        break;
+
+    case 3: {
+        auto d = (uint8_t *)dst;
+        auto s = (const uint8_t *)src;
+
+        for (long i = 0; i < frames; ++i, d += 3, s += 3) {
+            int32_t a = (int32_t)((d[0] << 8) | (d[1] << 16) | (d[2] << 24)) >> 8;
+            int32_t b = (int32_t)((s[0] << 8) | (s[1] << 16) | (s[2] << 24)) >> 8;
+            int32_t sum = a + b;
+
+            sum = sum < -0x800000 ? -0x800000 : sum > 0x7FFFFF ? 0x7FFFFF : sum;
+            d[0] = (uint8_t)sum;
+            d[1] = (uint8_t)(sum >> 8);
+            d[2] = (uint8_t)(sum >> 16);
+        }
+
+        break;
+    }
+    }
+}
+
 SarAsioWrapper::SarAsioWrapper()
 {
     LOG(INFO) << "SarAsioWrapper::SarAsioWrapper";
@@ -47,6 +144,7 @@ AsioBool SarAsioWrapper::init(void *sysHandle)
     }
 
     initVirtualChannels();
+    _channelTableValid = false;
 
     _sampleType = getSampleType();
     LOG(INFO) << "Sample type: " << (int)_sampleType << ", sample size: " << getSampleSize(_sampleType);
@@ -80,10 +178,24 @@ AsioStatus SarAsioWrapper::start()
         return AsioStatus::OK;
     }
 
-    _sar = std::make_shared<SarClient>(_config, _bufferConfig);
+    // A client paused by a persistent stop keeps its endpoints, so the audio
+    // engine never sees them disappear.
+    if (!_sar || !_sar->resume(_config, _bufferConfig)) {
+        if (_sar) {
+            _sar->stop();
+        }
+
+        _sar = std::make_shared<SarClient>(_config, _bufferConfig);
+
+        if (!_sar->start()) {
+            LOG(INFO) << "Failed to start SAR";
+            return AsioStatus::HardwareMalfunction;
+        }
+    }
+
+    if (_subTicks > 1 && !_subTicker.start(_sar, _subTicks,
+        _bufferConfig.periodFrameSize, _bufferConfig.sampleRate)) {
 
-    if (!_sar->start()) {
-        LOG(INFO) << "Failed to start SAR";
         return AsioStatus::HardwareMalfunction;
     }
 
@@ -98,6 +210,16 @@ AsioStatus SarAsioWrapper::stop()
         return AsioStatus::OK;
     }
 
+    _subTicker.stop();
+
+    // Pausing starts the idle clock, so the host's ticks must stop first.
+    if (_sar && _config.persistentEndpoints) {
+        auto status = _innerDriver->stop();
+
+        _sar->pause();
+        return status;
+    }
+
     if(_sar)
         _sar->stop();
 
@@ -113,14 +235,16 @@ AsioStatus SarAsioWrapper::getChannels(long *inputCount, long *outputCount)
         return AsioStatus::OK;
     }
 
-    auto status = _innerDriver->getChannels(inputCount, outputCount);
+    if (!_channelTableValid) {
+        auto status = refreshChannelTable();
 
-    if (status != AsioStatus::OK) {
-        return status;
+        if (status != AsioStatus::OK) {
+            return status;
+        }
     }
 
-    *inputCount += (long)_virtualInputs.size();
-    *outputCount += (long)_virtualOutputs.size();
+    *inputCount = (long)_channelTable[1].size();
+    *outputCount = (long)_channelTable[0].size();
     return AsioStatus::OK;
 }
 
@@ -133,7 +257,24 @@ AsioStatus SarAsioWrapper::getLatencies(long *inputLatency, long *outputLatency)
         return AsioStatus::OK;
     }
 
-    return _innerDriver->getLatencies(inputLatency, outputLatency);
+    auto status = _innerDriver->getLatencies(inputLatency, outputLatency);
+
+    if (status != AsioStatus::OK) {
+        return status;
+    }
+
+    double sampleRate = 0;
+
+    _innerDriver->getSampleRate(&sampleRate);
+
+    // Host inputs carry playback endpoints and host outputs feed recording
+    // endpoints, so each side picks up the longest delay on its endpoints.
+    *inputLatency += maxDelayFrames(
+        _config, EndpointType::Playback, sampleRate);
+    *outputLatency += maxDelayFrames(
+        _config, EndpointType::Recording, sampleRate);
+
+    return AsioStatus::OK;
 }
 
 AsioStatus SarAsioWrapper::getBufferSize(
@@ -154,9 +295,9 @@ AsioStatus SarAsioWrapper::getBufferSize(
         return status;
     }
 
-    // Limit the maximum buffer size to the system audio engine's periodicity if
-    // possible. This prevents audio glitches caused by the ASIO event loop not
-    // keeping up with the audio engine's event loop.
+    // Buffers longer than the audio engine's period are split into sub-ticks
+    // by createBuffers, but only sizes that split evenly can be used. Offer
+    // the inner driver's range up to the first size that doesn't.
     double sampleRate;
 
     status = getSampleRate(&sampleRate);
@@ -165,31 +306,26 @@ AsioStatus SarAsioWrapper::getBufferSize(
         return status;
     }
 
-    // The audio engine's periodicity is always 10ms unless overriden by the
-    // audio driver, which we don't do.
-    long maxBufferSize = (long)(sampleRate / 100.0);
-
-    // If we can't effectively limit the sample rate, give up and force the
-    // minimum buffer size to be used.
-    if (*minSize > maxBufferSize || !*granularity) {
-        *minSize = *preferredSize = *maxSize;
-        *granularity = 0;
+    if (!subTickCount(*minSize, sampleRate)) {
+        LOG(ERROR) << "Minimum buffer size " << *minSize
+            << " can't be split into sub-ticks.";
         return AsioStatus::OK;
     }
 
-    // Handle power of 2 buffer sizing.
-    if (*granularity == -1) {
-        while (*maxSize > maxBufferSize && *maxSize > *minSize) {
-            *maxSize /= 2;
-        }
-    } else {
-        while (*maxSize > maxBufferSize &&
-               *maxSize - *minSize >= *granularity) {
+    long size = *minSize;
+
+    while (size < *maxSize && *granularity) {
+        long next = *granularity == -1 ? size * 2 : size + *granularity;
 
-            *maxSize -= *granularity;
+        if (next > *maxSize || !subTickCount(next, sampleRate)) {
+            break;
         }
+
+        size = next;
     }
 
+    *maxSize = size;
+
     if (*preferredSize > *maxSize) {
         *preferredSize = *maxSize;
     }
@@ -287,33 +423,82 @@ AsioStatus SarAsioWrapper::getChannelInfo(AsioChannelInfo *info)
         return AsioStatus::OK;
     }
 
-    long inputChannels = 0, outputChannels = 0;
-    auto status = _innerDriver->getChannels(&inputChannels, &outputChannels);
+    if (!_channelTableValid) {
+        auto status = refreshChannelTable();
+
+        if (status != AsioStatus::OK) {
+            return status;
+        }
+    }
+
+    auto& channels = _channelTable[info->isInput == AsioBool::True];
+
+    if (info->index < 0 || info->index >= (long)channels.size()) {
+        return AsioStatus::NotPresent;
+    }
+
+    *info = channels[info->index];
+    return AsioStatus::OK;
+}
+
+AsioStatus SarAsioWrapper::refreshChannelTable()
+{
+    LARGE_INTEGER startCounter, endCounter, frequency;
+    long counts[2] = {}; // by isInput
+    AsioStatus status;
+
+    QueryPerformanceCounter(&startCounter);
+    _channelTable[0].clear();
+    _channelTable[1].clear();
+    status = _innerDriver->getChannels(&counts[1], &counts[0]);
 
     if (status != AsioStatus::OK) {
         return status;
     }
 
-    auto innerCount = info->isInput == AsioBool::True ?
-        inputChannels : outputChannels;
+    for (int isInput = 0; isInput < 2; ++isInput) {
+        auto& channels = _channelTable[isInput];
+        auto& virtualChannels = isInput ? _virtualInputs : _virtualOutputs;
 
-    if (info->index < innerCount) {
-        return _innerDriver->getChannelInfo(info);
-    }
+        for (long i = 0; i < counts[isInput]; ++i) {
+            AsioChannelInfo info = {};
 
-    auto& channels = info->isInput == AsioBool::True ?
-        _virtualInputs : _virtualOutputs;
-    auto index = info->index - innerCount;
+            info.index = i;
+            info.isInput = isInput ? AsioBool::True : AsioBool::False;
+            status = _innerDriver->getChannelInfo(&info);
 
-    if (index < (int)channels.size()) {
-        info->group = 0;
-        info->sampleType = (long)_sampleType;
-        info->isActive = AsioBool::False; // TODO: when is this true?
-        strcpy_s(info->name, channels[index].name.c_str());
-        return AsioStatus::OK;
+            if (status != AsioStatus::OK) {
+                _channelTable[0].clear();
+                _channelTable[1].clear();
+                return status;
+            }
+
+            channels.emplace_back(info);
+        }
+
+        for (auto& virtualChannel : virtualChannels) {
+            AsioChannelInfo info = {};
+
+            info.index = (long)channels.size();
+            info.isInput = isInput ? AsioBool::True : AsioBool::False;
+            info.group = 0;
+            info.sampleType = (long)_sampleType;
+            info.isActive = AsioBool::False; // TODO: when is this true?
+            strcpy_s(info.name, virtualChannel.name.c_str());
+            channels.emplace_back(info);
+        }
     }
 
-    return AsioStatus::NotPresent;
+    _channelTableValid = true;
+    QueryPerformanceCounter(&endCounter);
+    QueryPerformanceFrequency(&frequency);
+    LOG(INFO) << "Channel table: " << counts[1] << "+"
+        << _virtualInputs.size() << " inputs, " << counts[0] << "+"
+        << _virtualOutputs.size() << " outputs in "
+        << (endCounter.QuadPart - startCounter.QuadPart) * 1000.0 /
+            frequency.QuadPart
+        << " ms.";
+    return AsioStatus::OK;
 }
 
 AsioStatus SarAsioWrapper::createBuffers(
@@ -382,12 +567,24 @@ AsioStatus SarAsioWrapper::createBuffers(
         return status;
     }
 
-    // See comment in SarAsioWrapper::getBufferSize for details.
-    if (bufferFrameSize > (long)(sampleRate / 100.0)) {
-        LOG(ERROR) << "Invalid buffer size: larger than system audio engine periodicity";
+    // See subTickCount for details.
+    _subTicks = subTickCount(bufferFrameSize, sampleRate);
+
+    if (!_subTicks) {
+        LOG(ERROR) << "Invalid buffer size: " << bufferFrameSize
+            << " frames can't be split into sub-ticks of at least "
+            << SAR_MIN_SUB_TICK_FRAMES << " frames";
+        _subTicks = 1;
         return AsioStatus::InvalidMode;
     }
 
+    // Not added to getLatencies, which the host applies to physical channels
+    // as well, and those don't lag.
+    if (_subTicks > 1) {
+        LOG(INFO) << "Sub-ticking adds " << bufferFrameSize
+            << " frames of latency each way to virtual channels.";
+    }
+
     for (long i = 0; i < channelCount; ++i) {
         auto count = infos[i].isInput == AsioBool::True ?
             physicalInputCount : physicalOutputCount;
@@ -406,6 +603,86 @@ AsioStatus SarAsioWrapper::createBuffers(
         }
     }
 
+    // Attached endpoints bypass the host: recording endpoints read physical
+    // inputs and playback endpoints write physical outputs. Channels the host
+    // didn't ask for are requested from the inner driver alongside its own.
+    struct PhysicalAttachment
+    {
+        int endpointIndex;
+        int channelIndex;
+        size_t bufferPos;
+        bool sharedWithHost;
+    };
+
+    std::vector<PhysicalAttachment> attachments;
+
+    for (size_t endpointIndex = 0;
+         endpointIndex < _channelEndpoints.size(); ++endpointIndex) {
+
+        auto& endpoint = _channelEndpoints[endpointIndex];
+        auto isInput = endpoint.type == EndpointType::Recording ?
+            AsioBool::True : AsioBool::False;
+        auto count = isInput == AsioBool::True ?
+            physicalInputCount : physicalOutputCount;
+
+        if (!endpoint.attachPhysical) {
+            continue;
+        }
+
+        // Physical buffers only change hands at the ASIO switch, which
+        // sub-ticks don't line up with.
+        if (_subTicks > 1) {
+            LOG(WARNING) << "Not attaching endpoint " << endpointIndex
+                << " to physical channels: unsupported when sub-ticking.";
+            continue;
+        }
+
+        for (int i = 0; i < endpoint.channelCount; ++i) {
+            PhysicalAttachment attachment = {};
+            AsioChannelInfo query = {};
+            long index = endpoint.physicalChannelBase + i;
+
+            query.index = index;
+            query.isInput = isInput;
+
+            if (index < 0 || index >= count) {
+                break;
+            }
+
+            if (_innerDriver->getChannelInfo(&query) != AsioStatus::OK ||
+                query.sampleType != (long)_sampleType) {
+
+                LOG(WARNING) << "Physical channel " << index
+                    << " has an unsupported sample type, not attaching.";
+                continue;
+            }
+
+            attachment.endpointIndex = (int)endpointIndex;
+            attachment.channelIndex = i;
+            attachment.bufferPos = physicalChannelBuffers.size();
+
+            for (size_t j = 0; j < physicalChannelBuffers.size(); ++j) {
+                if (physicalChannelBuffers[j].index == index &&
+                    physicalChannelBuffers[j].isInput == isInput) {
+
+                    attachment.bufferPos = j;
+                    attachment.sharedWithHost = true;
+                    break;
+                }
+            }
+
+            if (!attachment.sharedWithHost) {
+                AsioBufferInfo info = {};
+
+                info.isInput = isInput;
+                info.index = index;
+                physicalChannelBuffers.emplace_back(info);
+            }
+
+            attachments.emplace_back(attachment);
+        }
+    }
+
     _userTick = callbacks->tick;
 
     if (callbacks->asioMessage(AsioMessage::SupportsTimeInfo,
@@ -430,6 +707,11 @@ AsioStatus SarAsioWrapper::createBuffers(
             << " isInput: " << (int)physical.isInput;
     }
 
+    if (!allocateBufferArena(bufferFrameSize)) {
+        LOG(ERROR) << "Couldn't allocate virtual channel buffers";
+        return AsioStatus::NoMemory;
+    }
+
     status = _innerDriver->createBuffers(
         physicalChannelBuffers.data(), (long)physicalChannelBuffers.size(),
         bufferFrameSize, &_callbacks);
@@ -437,26 +719,18 @@ AsioStatus SarAsioWrapper::createBuffers(
     if (status != AsioStatus::OK) {
         LOG(ERROR) << "Couldn't create inner driver buffers: "
             << (int)status;
+        freeBufferArena();
         return status;
     }
 
-    for (size_t i = 0; i < physicalChannelBuffers.size(); ++i) {
+    for (size_t i = 0; i < physicalChannelIndices.size(); ++i) {
         infos[physicalChannelIndices[i]] = physicalChannelBuffers[i];
     }
 
-    _bufferConfig.periodFrameSize = bufferFrameSize;
+    _bufferConfig.periodFrameSize = bufferFrameSize / _subTicks;
     _bufferConfig.sampleSize = getSampleSize(_sampleType);
     _bufferConfig.sampleRate = (int)sampleRate;
-
-
-    for (size_t swapIndex = 0; swapIndex < 2; swapIndex++) {
-        _bufferConfig.asioBuffers[swapIndex].resize(_config.endpoints.size());
-
-        for (size_t i = 0; i < _config.endpoints.size(); ++i) {
-            _bufferConfig.asioBuffers[swapIndex][i].resize(
-                _config.endpoints[i].channelCount);
-        }
-    }
+    _bufferConfig.setEndpoints(_channelEndpoints, 2 * _subTicks);
 
     for (auto i : virtualChannelIndices) {
         auto count = infos[i].isInput == AsioBool::True ?
@@ -465,18 +739,64 @@ AsioStatus SarAsioWrapper::createBuffers(
             _virtualInputs : _virtualOutputs;
         auto& channel = channels[infos[i].index - count];
 
-        channel.asioBuffers[0] =
-            infos[i].asioBuffers[0] = calloc(bufferFrameSize, getSampleSize(_sampleType));
-        channel.asioBuffers[1] =
-            infos[i].asioBuffers[1] = calloc(bufferFrameSize, getSampleSize(_sampleType));
-        _bufferConfig
-            .asioBuffers[0][channel.endpointIndex][channel.channelIndex] =
-                channel.asioBuffers[0];
-        _bufferConfig
-            .asioBuffers[1][channel.endpointIndex][channel.channelIndex] =
-                channel.asioBuffers[1];
+        for (int swapIndex = 0; swapIndex < 2; ++swapIndex) {
+            channel.asioBuffers[swapIndex] =
+                infos[i].asioBuffers[swapIndex] = arenaBuffer(
+                    channel.endpointIndex, swapIndex, channel.channelIndex);
+        }
+
+        // Sub-ticks of a period read the host outputs of its own switch, but
+        // fill the host inputs of the next one since this switch's inputs
+        // have already been handed over. Slices are back to back, so only
+        // the first keeps the arena's alignment and padding.
+        int sourceSwap = _subTicks > 1 &&
+            infos[i].isInput == AsioBool::True ? 1 : 0;
+
+        for (int swapIndex = 0; swapIndex < 2; ++swapIndex) {
+            auto base = (char *)channel.asioBuffers[swapIndex ^ sourceSwap];
+
+            for (int j = 0; j < _subTicks; ++j) {
+                _bufferConfig.buffer(swapIndex * _subTicks + j,
+                    channel.endpointIndex, channel.channelIndex) =
+                        base + (size_t)j * _bufferConfig.periodFrameSize *
+                            _bufferConfig.sampleSize;
+            }
+        }
+    }
+
+    for (auto& attachment : attachments) {
+        auto& physical = physicalChannelBuffers[attachment.bufferPos];
+        auto& endpoint = _channelEndpoints[attachment.endpointIndex];
+        void *buffers[2] = {
+            physical.asioBuffers[0], physical.asioBuffers[1]
+        };
+
+        // The host writes its outputs after we tick, so a shared output
+        // can't be written in place.
+        if (endpoint.type == EndpointType::Playback &&
+            attachment.sharedWithHost) {
+
+            PhysicalMix mix;
+
+            for (int swapIndex = 0; swapIndex < 2; ++swapIndex) {
+                mix.staging[swapIndex] = buffers[swapIndex] = arenaBuffer(
+                    attachment.endpointIndex, swapIndex,
+                    attachment.channelIndex);
+                mix.physical[swapIndex] = physical.asioBuffers[swapIndex];
+            }
+
+            _physicalMixes.emplace_back(mix);
+        }
+
+        for (int swapIndex = 0; swapIndex < 2; ++swapIndex) {
+            _bufferConfig.buffer(swapIndex,
+                attachment.endpointIndex, attachment.channelIndex) =
+                    buffers[swapIndex];
+        }
     }
 
+    // The inner driver marks the channels it made buffers for as active.
+    _channelTableValid = false;
     InterlockedCompareExchangePointer((PVOID *)&gActiveWrapper, this, nullptr);
 
     // We need a thiscall thunk to support multiple active instances, and
@@ -509,18 +829,22 @@ AsioStatus SarAsioWrapper::disposeBuffers()
 
     stop();
 
-    for (auto& swapBuffers : _bufferConfig.asioBuffers) {
-        for (auto& endpointBuffers : swapBuffers) {
-            for (auto buffer : endpointBuffers) {
-                free(buffer);
-            }
+    for (auto channels : { &_virtualInputs, &_virtualOutputs }) {
+        for (auto& channel : *channels) {
+            channel.asioBuffers[0] = nullptr;
+            channel.asioBuffers[1] = nullptr;
         }
-        swapBuffers.clear();
     }
 
+    _physicalMixes.clear();
+    freeBufferArena();
+
+    _bufferConfig.setEndpoints({});
+
     _callbacks = {};
     _userTick = nullptr;
     _userTickWithTime = nullptr;
+    _channelTableValid = false;
     InterlockedExchangePointer((PVOID *)&gActiveWrapper, nullptr);
     return _innerDriver->disposeBuffers();
 }
@@ -531,12 +855,47 @@ AsioStatus SarAsioWrapper::controlPanel()
     auto sheet = std::make_shared<ConfigurationPropertyDialog>(_config);
 
     if (sheet->show(_hwnd) > 0) {
-        _config = sheet->newConfig();
-        _config.writeFile(ConfigurationPath(L"default.json"));
+        auto newConfig = sheet->newConfig();
+        auto diff = DiffConfig(_config, newConfig);
+        bool needsReset = diff.needsReset;
+
+        newConfig.writeFile(ConfigurationPath(L"default.json"));
+
+        // Without a running client the new config is picked up on start.
+        if (!needsReset && _sar) {
+            needsReset = !_sar->reconfigure(newConfig, diff);
+        }
 
-        if (_callbacks.asioMessage) {
+        double sampleRate = 0;
+
+        if (_innerDriver) {
+            _innerDriver->getSampleRate(&sampleRate);
+        }
+
+        bool latenciesChanged =
+            maxDelayFrames(_config, EndpointType::Playback, sampleRate) !=
+                maxDelayFrames(
+                    newConfig, EndpointType::Playback, sampleRate) ||
+            maxDelayFrames(_config, EndpointType::Recording, sampleRate) !=
+                maxDelayFrames(
+                    newConfig, EndpointType::Recording, sampleRate);
+
+        _config = newConfig;
+
+        // Endpoints applied in place still need a reset if the host's
+        // channel list changed.
+        needsReset |= diff.channelsChanged;
+
+        if (needsReset) {
+            _channelTableValid = false;
+        }
+
+        if (needsReset && _callbacks.asioMessage) {
             _callbacks.asioMessage(
                 AsioMessage::ResetRequest, 0, nullptr, nullptr);
+        } else if (latenciesChanged && _callbacks.asioMessage) {
+            _callbacks.asioMessage(
+                AsioMessage::LatenciesChanged, 0, nullptr, nullptr);
         }
     }
 
@@ -563,35 +922,107 @@ AsioStatus SarAsioWrapper::outputReady()
     return _innerDriver->outputReady();
 }
 
+// Returns whether the configured interface was opened. Without one the
+// software clock stands in, so endpoints still tick with no hardware
+// selected.
 bool SarAsioWrapper::initInnerDriver()
 {
-    _innerDriver = nullptr;
-
-    for (auto driver : InstalledAsioDrivers()) {
-        if (driver.clsid == _config.driverClsid) {
-            if (!SUCCEEDED(driver.open(&_innerDriver))) {
-                return false;
+    auto drivers = InstalledAsioDrivers();
+    auto openDriver = [&](const std::string& clsid) {
+        for (auto& driver : drivers) {
+            if (driver.clsid != clsid) {
+                continue;
             }
 
-            if (_innerDriver->init(_hwnd) != AsioBool::True) {
-                return false;
+            if (SUCCEEDED(driver.open(&_innerDriver)) &&
+                _innerDriver->init(_hwnd) == AsioBool::True) {
+
+                return true;
             }
 
-            return true;
+            _innerDriver = nullptr;
+            return false;
         }
+
+        return false;
+    };
+
+    _innerDriver = nullptr;
+
+    if (!_config.driverClsid.empty() && openDriver(_config.driverClsid)) {
+        return true;
+    }
+
+    LOG(INFO) << "No usable ASIO interface, falling back to the software "
+        << "clock.";
+
+    if (!openDriver(SAR_SOFTWARE_CLOCK_CLSID)) {
+        LOG(ERROR) << "Couldn't start the software clock.";
     }
 
     return false;
 }
 
+// Attached endpoints point into the inner driver's buffers except for
+// staging, but get their slots anyway so offsets stay a simple prefix sum.
+bool SarAsioWrapper::allocateBufferArena(long bufferFrameSize)
+{
+    size_t size = 0;
+
+    freeBufferArena();
+    _arenaStride = (size_t)bufferFrameSize * getSampleSize(_sampleType);
+    _arenaStride = (_arenaStride + SAR_BUFFER_ALIGNMENT - 1) &
+        ~(size_t)(SAR_BUFFER_ALIGNMENT - 1);
+
+    for (auto& endpoint : _channelEndpoints) {
+        _arenaOffsets.push_back(size);
+        size += 2 * endpoint.channelCount * _arenaStride;
+    }
+
+    _bufferArena = (char *)_aligned_malloc(
+        max(size, (size_t)SAR_BUFFER_ALIGNMENT), SAR_BUFFER_ALIGNMENT);
+
+    if (!_bufferArena) {
+        _arenaOffsets.clear();
+        return false;
+    }
+
+    ZeroMemory(_bufferArena, size);
+    return true;
+}
+
+void SarAsioWrapper::freeBufferArena()
+{
+    _aligned_free(_bufferArena);
+    _bufferArena = nullptr;
+    _arenaOffsets.clear();
+}
+
+void *SarAsioWrapper::arenaBuffer(
+    int endpointIndex, int swapIndex, int channelIndex)
+{
+    auto channelCount = _channelEndpoints[endpointIndex].channelCount;
+
+    return _bufferArena + _arenaOffsets[endpointIndex] +
+        (swapIndex * channelCount + channelIndex) * _arenaStride;
+}
+
 void SarAsioWrapper::initVirtualChannels()
 {
     _virtualInputs.clear();
     _virtualOutputs.clear();
+    _channelEndpoints = _config.endpoints;
 
     int endpointIndex = 0;
 
-    for (auto& endpoint : _config.endpoints) {
+    for (auto& endpoint : _channelEndpoints) {
+        // Attached endpoints are routed in the driver, out of the host's
+        // sight.
+        if (endpoint.attachPhysical) {
+            endpointIndex++;
+            continue;
+        }
+
         for (int i = 0; i < endpoint.channelCount; ++i) {
             VirtualChannel chan;
             std::ostringstream os;
@@ -614,8 +1045,24 @@ void SarAsioWrapper::initVirtualChannels()
 
 void SarAsioWrapper::onTick(long bufferIndex, AsioBool directProcess)
 {
+    if (_subTicks > 1) {
+        _subTicker.finishPeriod();
+        _userTick(bufferIndex, directProcess);
+        _subTicker.beginPeriod(bufferIndex);
+        return;
+    }
+
     _sar->tick(bufferIndex);
     _userTick(bufferIndex, directProcess);
+    mixPhysicalOutputs(bufferIndex);
+}
+
+void SarAsioWrapper::mixPhysicalOutputs(long bufferIndex)
+{
+    for (auto& mix : _physicalMixes) {
+        mixSamples(mix.physical[bufferIndex], mix.staging[bufferIndex],
+            _bufferConfig.periodFrameSize, _bufferConfig.sampleSize);
+    }
 }
 
 void SarAsioWrapper::onTickStub(long bufferIndex, AsioBool directProcess)
@@ -630,8 +1077,17 @@ void SarAsioWrapper::onTickStub(long bufferIndex, AsioBool directProcess)
 AsioTime *SarAsioWrapper::onTickWithTime(
     AsioTime *time, long bufferIndex, AsioBool directProcess)
 {
+    if (_subTicks > 1) {
+        _subTicker.finishPeriod();
+        time = _userTickWithTime(time, bufferIndex, directProcess);
+        _subTicker.beginPeriod(bufferIndex);
+        return time;
+    }
+
     _sar->tick(bufferIndex);
-    return _userTickWithTime(time, bufferIndex, directProcess);
+    time = _userTickWithTime(time, bufferIndex, directProcess);
+    mixPhysicalOutputs(bufferIndex);
+    return time;
 }
 
 AsioTime *SarAsioWrapper::onTickWithTimeStub(
@@ -19,6 +19,7 @@
 
 #include "config.h"
 #include "sarclient.h"
+#include "subticker.h"
 #include "network.h"
 #include "tinyasio.h"
 
@@ -87,8 +88,22 @@ private:
         void *asioBuffers[2];
     };
 
+    // A playback endpoint attached to a physical output the host also
+    // writes. The endpoint is demuxed to staging and added to the host's
+    // output once the host's buffer switch has filled it.
+    struct PhysicalMix
+    {
+        void *staging[2];
+        void *physical[2];
+    };
+
     bool initInnerDriver();
     void initVirtualChannels();
+    AsioStatus refreshChannelTable();
+    bool allocateBufferArena(long bufferFrameSize);
+    void freeBufferArena();
+    void *arenaBuffer(int endpointIndex, int swapIndex, int channelIndex);
+    void mixPhysicalOutputs(long bufferIndex);
     void onTick(long bufferIndex, AsioBool directProcess);
     AsioTime *onTickWithTime(
         AsioTime *time, long bufferIndex, AsioBool directProcess);
@@ -102,10 +117,28 @@ private:
     DriverConfig _config;
     BufferConfig _bufferConfig;
     std::shared_ptr<SarClient> _sar;
+    int _subTicks = 1; // SarClient ticks per ASIO period
+    SubTicker _subTicker;
     std::shared_ptr<SarCastMaster> _castMaster;
     CComPtr<IASIO> _innerDriver;
+    std::vector<EndpointConfig> _channelEndpoints; // what the host sees
     std::vector<VirtualChannel> _virtualInputs;
     std::vector<VirtualChannel> _virtualOutputs;
+    std::vector<PhysicalMix> _physicalMixes;
+
+    // What getChannels and getChannelInfo report, indexed by isInput and
+    // then channel index. Hosts ask once per channel and vendor drivers can
+    // be slow to answer, so this is only rebuilt when invalidated: on init,
+    // when buffers are created or disposed, and on a reset request, which
+    // hosts answer by disposing and reinitializing anyway.
+    std::array<std::vector<AsioChannelInfo>, 2> _channelTable;
+    bool _channelTableValid = false;
+
+    // Every buffer handed out for _channelEndpoints, laid out
+    // [endpoint][swap index][channel] with SAR_BUFFER_ALIGNMENT strides.
+    char *_bufferArena = nullptr;
+    size_t _arenaStride = 0;
+    std::vector<size_t> _arenaOffsets; // by endpoint index
     AsioTickCallback *_userTick;
     AsioTickWithTimeCallback *_userTickWithTime;
     AsioCallbacks _callbacks = {};
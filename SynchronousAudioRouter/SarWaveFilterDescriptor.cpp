@@ -112,8 +112,8 @@ NTSTATUS SarWaveFilterDescriptor::initWaveFilter(const SarControlContext *contro
             request->channelCount, // MaximumChannels
             controlContext->sampleSize * 8, // MinimumBitsPerSample
             controlContext->sampleSize * 8, // MaximumBitsPerSample
-            controlContext->sampleRate, // MinimumSampleFrequency
-            controlContext->sampleRate, // MaximumSampleFrequency
+            request->sampleRate, // MinimumSampleFrequency
+            request->sampleRate, // MaximumSampleFrequency
         },
         { // analogDataRange
             sizeof(analogDataRange), // FormatSize
@@ -33,6 +33,9 @@ NTSTATUS SarSetBufferLayout(
     GUID sectionGuid = {};
     PULONG bufferMap = nullptr;
     DWORD bufferSize = 0;
+    PVOID sectionObject = nullptr;
+    PVOID systemBaseAddress = nullptr;
+    SIZE_T systemViewSize = 0;
 
     if (request->bufferSize == 0 ||
         request->bufferSize > SAR_MAX_BUFFER_SIZE ||
@@ -87,7 +90,28 @@ NTSTATUS SarSetBufferLayout(
         SAR_ERROR("Couldn't map view of section");
         goto err_out;
     }
-    
+
+    // Give the section a system space view as well, so kernel side register
+    // access doesn't depend on which process we're called from. Unlike the
+    // client's view it lives as long as the control context, whichever
+    // process tears that down.
+    status = ObReferenceObjectByHandle(section,
+        SECTION_MAP_READ|SECTION_MAP_WRITE, nullptr, KernelMode,
+        &sectionObject, nullptr);
+
+    if (!NT_SUCCESS(status)) {
+        SAR_ERROR("Couldn't reference buffer section %08X", status);
+        goto err_out;
+    }
+
+    status = MmMapViewInSystemSpace(
+        sectionObject, &systemBaseAddress, &systemViewSize);
+
+    if (!NT_SUCCESS(status)) {
+        SAR_ERROR("Couldn't map register file to system space %08X", status);
+        goto err_out;
+    }
+
     ExAcquireFastMutex(&controlContext->mutex);
 
     if (controlContext->bufferSize) {
@@ -108,6 +132,13 @@ NTSTATUS SarSetBufferLayout(
     controlContext->bufferMapStorage = bufferMap;
     bufferMap = nullptr;
 
+    controlContext->bufferSectionObject = sectionObject;
+    controlContext->systemViewBaseAddress = systemBaseAddress;
+    controlContext->registerFile = (SarEndpointRegisters *)
+        ((PUCHAR)systemBaseAddress + bufferSize);
+    sectionObject = nullptr;
+    systemBaseAddress = nullptr;
+
     controlContext->sectionViewBaseAddress = baseAddress;
     baseAddress = nullptr;
 
@@ -121,6 +152,14 @@ NTSTATUS SarSetBufferLayout(
     return STATUS_SUCCESS;
 
 err_out:
+    if (systemBaseAddress) {
+        MmUnmapViewInSystemSpace(systemBaseAddress);
+    }
+
+    if (sectionObject) {
+        ObDereferenceObject(sectionObject);
+    }
+
     if (baseAddress) {
         ZwUnmapViewOfSection(ZwCurrentProcess(), baseAddress);
     }
@@ -285,12 +324,45 @@ out:
     return status;
 }
 
+// Detaches the endpoints of a finished batch from it. A batch succeeds or
+// fails as a whole, since the client can't tell which of its endpoints
+// exist otherwise, so if any endpoint failed the ones that were registered
+// are moved to orphanEndpoints to be orphaned once the mutex is dropped.
+// Called with the control context mutex held.
+static VOID SarFinishEndpointBatch(
+    SarControlContext *controlContext,
+    SarPendingEndpointBatch *batch,
+    PLIST_ENTRY orphanEndpoints)
+{
+    PLIST_ENTRY entry = controlContext->endpointList.Flink;
+
+    while (entry != &controlContext->endpointList) {
+        SarEndpoint *endpoint =
+            CONTAINING_RECORD(entry, SarEndpoint, listEntry);
+
+        entry = entry->Flink;
+
+        if (endpoint->pendingBatch != batch) {
+            continue;
+        }
+
+        endpoint->pendingBatch = nullptr;
+
+        if (!NT_SUCCESS(batch->status)) {
+            RemoveEntryList(&endpoint->listEntry);
+            InsertTailList(orphanEndpoints, &endpoint->listEntry);
+        }
+    }
+}
+
 VOID SarProcessPendingEndpoints(PDEVICE_OBJECT deviceObject, PVOID context)
 {
     UNREFERENCED_PARAMETER(deviceObject);
     NTSTATUS status = STATUS_UNSUCCESSFUL;
     SarControlContext *controlContext = (SarControlContext *)context;
+    LIST_ENTRY orphanEndpoints;
 
+    InitializeListHead(&orphanEndpoints);
     ExAcquireFastMutex(&controlContext->mutex);
 
 retry:
@@ -305,6 +377,7 @@ retry:
         PUNICODE_STRING topologySymlink;
         PLIST_ENTRY current = entry;
         PIRP pendingIrp = endpoint->pendingIrp;
+        SarPendingEndpointBatch *batch = endpoint->pendingBatch;
 
         entry = endpoint->listEntry.Flink;
         RemoveEntryList(current);
@@ -381,8 +454,22 @@ out:
             SarReleaseEndpoint(endpoint);
         }
 
-        pendingIrp->IoStatus.Status = status;
-        IoCompleteRequest(pendingIrp, IO_NO_INCREMENT);
+        if (batch) {
+            if (!NT_SUCCESS(status) && NT_SUCCESS(batch->status)) {
+                batch->status = status;
+            }
+
+            if (--batch->remaining == 0) {
+                SarFinishEndpointBatch(
+                    controlContext, batch, &orphanEndpoints);
+                batch->irp->IoStatus.Status = batch->status;
+                IoCompleteRequest(batch->irp, IO_NO_INCREMENT);
+                ExFreePoolWithTag(batch, SAR_TAG);
+            }
+        } else {
+            pendingIrp->IoStatus.Status = status;
+            IoCompleteRequest(pendingIrp, IO_NO_INCREMENT);
+        }
     }
 
     // Someone added a new endpoint request while we were working with locks
@@ -392,14 +479,23 @@ out:
     }
 
     ExReleaseFastMutex(&controlContext->mutex);
+
+    while (!IsListEmpty(&orphanEndpoints)) {
+        PLIST_ENTRY orphan = RemoveHeadList(&orphanEndpoints);
+
+        SarOrphanEndpoint(CONTAINING_RECORD(orphan, SarEndpoint, listEntry));
+    }
+
     SarReleaseControlContext(controlContext);
 }
 
-NTSTATUS SarCreateEndpoint(
+// Builds an endpoint and its filter factories. The caller owns the result
+// and is responsible for queueing it on pendingEndpointList.
+static NTSTATUS SarBuildEndpoint(
     PDEVICE_OBJECT device,
-    PIRP irp,
     SarControlContext *controlContext,
-    SarCreateEndpointRequest *request)
+    SarCreateEndpointRequest *request,
+    SarEndpoint **outEndpoint)
 {
     NTSTATUS status = STATUS_SUCCESS;
     PKSDEVICE ksDevice = KsGetDeviceForDeviceObject(device);
@@ -417,6 +513,12 @@ NTSTATUS SarCreateEndpoint(
         return STATUS_INVALID_PARAMETER;
     }
 
+    if (request->sampleRate &&
+        (request->sampleRate < SAR_MIN_SAMPLE_RATE ||
+         request->sampleRate > SAR_MAX_SAMPLE_RATE)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
     // Endpoints assume buffer parameters are not 0 (else division by 0 could occur)
     if (!controlContext->bufferSize) {
         SAR_ERROR("Creating endpoints require setting buffer beforehand");
@@ -427,6 +529,10 @@ NTSTATUS SarCreateEndpoint(
         return status;
     }
 
+    if (!request->sampleRate) {
+        request->sampleRate = controlContext->sampleRate;
+    }
+
     status = STATUS_INSUFFICIENT_RESOURCES;
     endpoint = (SarEndpoint *)
         ExAllocatePoolWithTag(NonPagedPool, sizeof(SarEndpoint), SAR_TAG);
@@ -439,12 +545,25 @@ NTSTATUS SarCreateEndpoint(
     endpoint->refs = 1;
     ExInitializeFastMutex(&endpoint->mutex);
     InitializeListHead(&endpoint->activeProcessList);
-    endpoint->pendingIrp = irp;
     endpoint->channelCount = request->channelCount;
     endpoint->channelMask = KSAUDIO_SPEAKER_DIRECTOUT;
     endpoint->type = request->type;
     endpoint->index = request->index;
     endpoint->owner = controlContext;
+    endpoint->sampleRate = request->sampleRate;
+    endpoint->periodSizeBytes = controlContext->periodSizeBytes;
+
+    // The client converts between the endpoint's rate and the ASIO rate, so
+    // the frames it moves per tick vary by one around the rate ratio.
+    if (endpoint->sampleRate != controlContext->sampleRate) {
+        ULONG64 periodFrames =
+            controlContext->periodSizeBytes / controlContext->sampleSize;
+
+        endpoint->periodSizeBytes = (DWORD)(
+            ((periodFrames * endpoint->sampleRate +
+              controlContext->sampleRate - 1) /
+             controlContext->sampleRate + 1) * controlContext->sampleSize);
+    }
 
     endpoint->filterDescriptor.initWaveFilter(controlContext, request);
     endpoint->topologyDescriptor.initTopologyFilter(request);
@@ -485,7 +604,7 @@ NTSTATUS SarCreateEndpoint(
 
         RtlUnicodeStringPrintf(&deviceIdBuffer,
             L"%ws_%u_%u_%u", request->id, request->channelCount,
-            controlContext->sampleRate, controlContext->sampleSize);
+            endpoint->sampleRate, controlContext->sampleSize);
         status = SarStringDuplicate(
             &endpoint->deviceIdMangled, &deviceIdBuffer);
 
@@ -531,16 +650,42 @@ NTSTATUS SarCreateEndpoint(
         goto err_out;
     }
 
-    // Only call IoMarkIrpPending when there is no error and we WILL return STATUS_PENDING
-    // but before any chance for the IRP to be completed (in SarProcessPendingEndpoints)
-    // So before queuing the endpoint to the pendingEndpointList list
+    *outEndpoint = endpoint;
+    return STATUS_SUCCESS;
+
+err_out:
+    if (!deviceNameAllocated) {
+        endpoint->deviceName = {};
+    }
+
+    if (!deviceIdAllocated) {
+        endpoint->deviceId = {};
+    }
+
+    SarDeleteEndpoint(endpoint);
+    return status;
+}
+
+// Moves built endpoints onto pendingEndpointList, kicking the work item if it
+// isn't already running. Only call IoMarkIrpPending when there is no error
+// and we WILL return STATUS_PENDING, but before any chance for the IRP to be
+// completed in SarProcessPendingEndpoints, so before queueing.
+static VOID SarQueuePendingEndpoints(
+    PIRP irp,
+    SarControlContext *controlContext,
+    PLIST_ENTRY endpoints)
+{
     IoMarkIrpPending(irp);
 
     ExAcquireFastMutex(&controlContext->mutex);
 
     BOOLEAN runWorkItem = IsListEmpty(&controlContext->pendingEndpointList);
 
-    InsertTailList(&controlContext->pendingEndpointList, &endpoint->listEntry);
+    while (!IsListEmpty(endpoints)) {
+        PLIST_ENTRY entry = RemoveHeadList(endpoints);
+
+        InsertTailList(&controlContext->pendingEndpointList, entry);
+    }
 
     if (runWorkItem) {
         SarRetainControlContext(controlContext);
@@ -550,25 +695,126 @@ NTSTATUS SarCreateEndpoint(
     }
 
     ExReleaseFastMutex(&controlContext->mutex);
+}
 
+NTSTATUS SarCreateEndpoint(
+    PDEVICE_OBJECT device,
+    PIRP irp,
+    SarControlContext *controlContext,
+    SarCreateEndpointRequest *request)
+{
+    NTSTATUS status;
+    SarEndpoint *endpoint;
+    LIST_ENTRY endpoints;
+
+    status = SarBuildEndpoint(device, controlContext, request, &endpoint);
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
 
+    endpoint->pendingIrp = irp;
+    InitializeListHead(&endpoints);
+    InsertTailList(&endpoints, &endpoint->listEntry);
+    SarQueuePendingEndpoints(irp, controlContext, &endpoints);
     SAR_DEBUG("Created endpoint %p with context %p", endpoint, controlContext);
+    return STATUS_PENDING;
+}
+
+// Builds every endpoint before queueing any of them so a bad request fails
+// the whole batch synchronously. Queued together, the endpoints are
+// registered by a single pass of SarProcessPendingEndpoints rather than one
+// work item round trip per endpoint.
+NTSTATUS SarCreateEndpoints(
+    PDEVICE_OBJECT device,
+    PIRP irp,
+    SarControlContext *controlContext,
+    SarCreateEndpointRequest *requests,
+    ULONG requestCount)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    SarPendingEndpointBatch *batch;
+    LIST_ENTRY endpoints;
+
+    if (requestCount == 0 || requestCount > SAR_MAX_ENDPOINT_COUNT) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    batch = (SarPendingEndpointBatch *)ExAllocatePoolWithTag(
+        NonPagedPool, sizeof(SarPendingEndpointBatch), SAR_TAG);
+
+    if (!batch) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
+    batch->irp = irp;
+    batch->remaining = (LONG)requestCount;
+    batch->status = STATUS_SUCCESS;
+    InitializeListHead(&endpoints);
+
+    for (ULONG i = 0; i < requestCount; ++i) {
+        SarEndpoint *endpoint;
+
+        status = SarBuildEndpoint(
+            device, controlContext, &requests[i], &endpoint);
+
+        if (!NT_SUCCESS(status)) {
+            goto err_out;
+        }
+
+        endpoint->pendingBatch = batch;
+        InsertTailList(&endpoints, &endpoint->listEntry);
+    }
+
+    SarQueuePendingEndpoints(irp, controlContext, &endpoints);
+    SAR_DEBUG("Created %lu endpoints with context %p",
+        requestCount, controlContext);
     return STATUS_PENDING;
 
 err_out:
-    if (!deviceNameAllocated) {
-        endpoint->deviceName = {};
-    }
+    while (!IsListEmpty(&endpoints)) {
+        PLIST_ENTRY entry = RemoveHeadList(&endpoints);
 
-    if (!deviceIdAllocated) {
-        endpoint->deviceId = {};
+        SarReleaseEndpoint(CONTAINING_RECORD(entry, SarEndpoint, listEntry));
     }
 
-    SarDeleteEndpoint(endpoint);
+    ExFreePoolWithTag(batch, SAR_TAG);
     return status;
 }
 
+NTSTATUS SarRemoveEndpoint(
+    SarControlContext *controlContext,
+    SarRemoveEndpointRequest *request)
+{
+    SarEndpoint *endpoint = nullptr;
+
+    ExAcquireFastMutex(&controlContext->mutex);
+
+    for (PLIST_ENTRY entry = controlContext->endpointList.Flink;
+         entry != &controlContext->endpointList;
+         entry = entry->Flink) {
+
+        SarEndpoint *candidate =
+            CONTAINING_RECORD(entry, SarEndpoint, listEntry);
+
+        if (candidate->index == request->index) {
+            RemoveEntryList(&candidate->listEntry);
+            endpoint = candidate;
+            break;
+        }
+    }
+
+    ExReleaseFastMutex(&controlContext->mutex);
+
+    if (!endpoint) {
+        return STATUS_NOT_FOUND;
+    }
+
+    SAR_DEBUG("Removing endpoint %p at index %lu", endpoint, request->index);
+    SarOrphanEndpoint(endpoint);
+    return STATUS_SUCCESS;
+}
+
 VOID SarDeleteEndpoint(SarEndpoint *endpoint)
 {
     SAR_DEBUG("Deleting endpoint %p", endpoint);
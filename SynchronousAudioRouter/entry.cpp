@@ -18,14 +18,19 @@
 #include "sar.h"
 
 static void SarDeleteRegistryRedirect(PVOID ptr);
+static VOID SarCaptureAllRegistrySnapshots(SarDriverExtension *extension);
 
 DRIVER_UNLOAD SarUnload;
 EX_CALLBACK_FUNCTION SarRegistryCallback;
+VOID SarProcessNotify(HANDLE parentId, HANDLE processId, BOOLEAN create);
 _Dispatch_type_(IRP_MJ_CREATE) DRIVER_DISPATCH SarIrpCreate;
 _Dispatch_type_(IRP_MJ_DEVICE_CONTROL) DRIVER_DISPATCH SarIrpDeviceControl;
 _Dispatch_type_(IRP_MJ_CLOSE) DRIVER_DISPATCH SarIrpClose;
 _Dispatch_type_(IRP_MJ_CLEANUP) DRIVER_DISPATCH SarIrpCleanup;
 
+// The process notify routine has no context argument.
+static SarDriverExtension *gProcessNotifyExtension = nullptr;
+
 static KSDEVICE_DISPATCH gDeviceDispatch = {
     SarKsDeviceAdd, // Add
     nullptr, // Start
@@ -107,6 +112,20 @@ VOID SarDeleteControlContext(SarControlContext *controlContext)
         controlContext->workItem = nullptr;
     }
 
+    // Drop any handles posted after the context was orphaned.
+    SarCancelAllHandleQueueIrps(&controlContext->handleQueue);
+
+    if (controlContext->systemViewBaseAddress) {
+        MmUnmapViewInSystemSpace(controlContext->systemViewBaseAddress);
+        controlContext->systemViewBaseAddress = nullptr;
+        controlContext->registerFile = nullptr;
+    }
+
+    if (controlContext->bufferSectionObject) {
+        ObDereferenceObject(controlContext->bufferSectionObject);
+        controlContext->bufferSectionObject = nullptr;
+    }
+
     if (controlContext->sectionViewBaseAddress) {
         ZwUnmapViewOfSection(ZwCurrentProcess(), controlContext->sectionViewBaseAddress);
         controlContext->sectionViewBaseAddress = nullptr;
@@ -637,6 +656,52 @@ NTSTATUS SarIrpDeviceControl(PDEVICE_OBJECT deviceObject, PIRP irp)
                 deviceObject, irp, controlContext, &request);
             break;
         }
+        case SAR_CREATE_ENDPOINTS: {
+            SAR_INFO("create audio endpoints");
+            SarCreateEndpointRequest *requests;
+            ULONG inputLength =
+                irpStack->Parameters.DeviceIoControl.InputBufferLength;
+            ULONG requestCount = inputLength / sizeof(SarCreateEndpointRequest);
+
+            if (requestCount == 0 || requestCount > SAR_MAX_ENDPOINT_COUNT ||
+                inputLength % sizeof(SarCreateEndpointRequest)) {
+
+                ntStatus = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            requests = (SarCreateEndpointRequest *)ExAllocatePoolWithTag(
+                NonPagedPool, inputLength, SAR_TAG);
+
+            if (!requests) {
+                ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+                break;
+            }
+
+            ntStatus = SarReadUserBuffer(requests, irp, inputLength);
+
+            if (NT_SUCCESS(ntStatus)) {
+                ntStatus = SarCreateEndpoints(
+                    deviceObject, irp, controlContext, requests, requestCount);
+            }
+
+            ExFreePoolWithTag(requests, SAR_TAG);
+            break;
+        }
+        case SAR_REMOVE_ENDPOINT: {
+            SAR_INFO("remove audio endpoint");
+            SarRemoveEndpointRequest request;
+
+            ntStatus = SarReadUserBuffer(
+                &request, irp, sizeof(SarRemoveEndpointRequest));
+
+            if (!NT_SUCCESS(ntStatus)) {
+                break;
+            }
+
+            ntStatus = SarRemoveEndpoint(controlContext, &request);
+            break;
+        }
         case SAR_WAIT_HANDLE_QUEUE: {
             SAR_INFO("wait handle queue");
             ntStatus = SarWaitHandleQueue(&controlContext->handleQueue, irp);
@@ -665,6 +730,20 @@ NTSTATUS SarIrpDeviceControl(PDEVICE_OBJECT deviceObject, PIRP irp)
                 break;
             }
 
+            if (!extension->processNotifyRegistered) {
+                gProcessNotifyExtension = extension;
+                ntStatus = PsSetCreateProcessNotifyRoutine(
+                    SarProcessNotify, FALSE);
+
+                if (!NT_SUCCESS(ntStatus)) {
+                    ExReleaseFastMutexUnsafe(&extension->mutex);
+                    KeLeaveCriticalRegion();
+                    break;
+                }
+
+                extension->processNotifyRegistered = TRUE;
+            }
+
             ntStatus = CmRegisterCallbackEx(
                 SarRegistryCallback,
                 &filterAltitude,
@@ -674,6 +753,11 @@ NTSTATUS SarIrpDeviceControl(PDEVICE_OBJECT deviceObject, PIRP irp)
                 nullptr);
             ExReleaseFastMutexUnsafe(&extension->mutex);
             KeLeaveCriticalRegion();
+
+            if (NT_SUCCESS(ntStatus)) {
+                SarCaptureAllRegistrySnapshots(extension);
+            }
+
             break;
         }
         case SAR_SEND_FORMAT_CHANGE_EVENT:
@@ -710,11 +794,17 @@ VOID SarUnload(PDRIVER_OBJECT driverObject)
         CmUnRegisterCallback(extension->filterCookie);
     }
 
+    if (extension->processNotifyRegistered) {
+        PsSetCreateProcessNotifyRoutine(SarProcessNotify, TRUE);
+        extension->processNotifyRegistered = FALSE;
+    }
+
     irql = ExAcquireSpinLockExclusive(&extension->registryRedirectLock);
     SarClearStringTable(
         &extension->registryRedirectTableWow64, SarDeleteRegistryRedirect);
     SarClearStringTable(
         &extension->registryRedirectTable, SarDeleteRegistryRedirect);
+    extension->registrySnapshotCount = 0;
     ExReleaseSpinLockExclusive(&extension->registryRedirectLock, irql);
 
     if (extension->filterUser) {
@@ -723,8 +813,54 @@ VOID SarUnload(PDRIVER_OBJECT driverObject)
     }
 }
 
+static ULONG SarProcessVerdictSlot(HANDLE processId)
+{
+    // Process ids are multiples of four.
+    return (ULONG)((ULONG_PTR)processId >> 2) &
+        (SAR_PROCESS_VERDICT_CACHE_SIZE - 1);
+}
+
+VOID SarProcessNotify(HANDLE parentId, HANDLE processId, BOOLEAN create)
+{
+    UNREFERENCED_PARAMETER(parentId);
+    UNREFERENCED_PARAMETER(create);
+
+    SarDriverExtension *extension = gProcessNotifyExtension;
+    ULONG slot = SarProcessVerdictSlot(processId);
+    KIRQL irql;
+
+    // Drop the verdict on both creation and exit, so a reused id never picks
+    // up a stale entry.
+    irql = ExAcquireSpinLockExclusive(&extension->processVerdictLock);
+
+    if (extension->processVerdicts[slot].processId == processId) {
+        extension->processVerdicts[slot].processId = nullptr;
+    }
+
+    ExReleaseSpinLockExclusive(&extension->processVerdictLock, irql);
+}
+
 BOOL SarFilterMatchesCurrentProcess(SarDriverExtension *extension)
 {
+    HANDLE processId = PsGetCurrentProcessId();
+    ULONG slot = SarProcessVerdictSlot(processId);
+    BOOLEAN isCached = FALSE;
+    BOOL isMatch = FALSE;
+    KIRQL irql;
+
+    irql = ExAcquireSpinLockShared(&extension->processVerdictLock);
+
+    if (extension->processVerdicts[slot].processId == processId) {
+        isMatch = extension->processVerdicts[slot].isMatch;
+        isCached = TRUE;
+    }
+
+    ExReleaseSpinLockShared(&extension->processVerdictLock, irql);
+
+    if (isCached) {
+        return isMatch;
+    }
+
     PTOKEN_USER tokenUser = nullptr;
     NTSTATUS status = SarCopyProcessUser(PsGetCurrentProcess(), &tokenUser);
 
@@ -732,20 +868,28 @@ BOOL SarFilterMatchesCurrentProcess(SarDriverExtension *extension)
         return FALSE;
     }
 
-    BOOL isMatch = RtlEqualSid(
+    isMatch = RtlEqualSid(
         extension->filterUser->User.Sid,
         tokenUser->User.Sid);
 
     ExFreePool(tokenUser);
+
+    // We're running in the process, so it can't have exited (and had its
+    // notification delivered) before the entry goes in.
+    irql = ExAcquireSpinLockExclusive(&extension->processVerdictLock);
+    extension->processVerdicts[slot].processId = processId;
+    extension->processVerdicts[slot].isMatch = (BOOLEAN)isMatch;
+    ExReleaseSpinLockExclusive(&extension->processVerdictLock, irql);
     return isMatch;
 }
 
 BOOL SarFilterMatchesPath(
     SarDriverExtension *extension,
     PCUNICODE_STRING path,
-    PUNICODE_STRING redirectPath)
+    SarRegistryRedirect **redirect)
 {
     PRTL_AVL_TABLE table = &extension->registryRedirectTable;
+    SarRegistryPrefilter *prefilter = &extension->registryPrefilter;
     PVOID entry = nullptr;
     KIRQL irql;
     UNICODE_STRING nonpagedPath;
@@ -758,9 +902,16 @@ BOOL SarFilterMatchesPath(
 #ifdef _WIN64
     if (IoIs32bitProcess(nullptr)) {
         table = &extension->registryRedirectTableWow64;
+        prefilter = &extension->registryPrefilterWow64;
     }
 #endif
 
+    // Almost every key we see is a miss, so turn those away before paying
+    // for the allocation and the lock below.
+    if (!SarRegistryPrefilterMayMatch(prefilter, path)) {
+        return FALSE;
+    }
+
     // TODO: we get a path that's in paged memory from the configuration manager
     // so we can't access it with IRQL raised to dispatch level by the spinlock.
     // Probably better to just use an ERESOURCE or something here instead.
@@ -770,11 +921,13 @@ BOOL SarFilterMatchesPath(
         return FALSE;
     }
 
+    // Redirects live until unload, so the pointer stays good after the lock
+    // is dropped.
     irql = ExAcquireSpinLockShared(&extension->registryRedirectLock);
     entry = SarGetStringTableEntry(table, &nonpagedPath);
 
     if (entry) {
-        *redirectPath = *(PCUNICODE_STRING)entry;
+        *redirect = (SarRegistryRedirect *)entry;
     }
 
     ExReleaseSpinLockShared(&extension->registryRedirectLock, irql);
@@ -782,9 +935,391 @@ BOOL SarFilterMatchesPath(
     return entry != nullptr;
 }
 
+static void SarReleaseRegistrySnapshot(SarRegistryValueSnapshot *snapshot)
+{
+    if (snapshot && InterlockedDecrement(&snapshot->refs) == 0) {
+        ExFreePoolWithTag(snapshot, SAR_TAG);
+    }
+}
+
+// Reads the default value (or the value at index 0 if enumerate is set) of
+// the given key into a new snapshot. Fails without a snapshot if the key
+// can't be opened, so that a wrapper registered later is still picked up.
+static NTSTATUS SarCaptureRegistrySnapshot(
+    PUNICODE_STRING keyPath,
+    BOOLEAN enumerate,
+    SarRegistryValueSnapshot **snapshot)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    OBJECT_ATTRIBUTES oa;
+    HANDLE key = nullptr;
+    UNICODE_STRING valueName = {};
+    PKEY_VALUE_FULL_INFORMATION info = nullptr;
+    ULONG length = 0, resultLength = 0;
+    SarRegistryValueSnapshot *newSnapshot = nullptr;
+
+    *snapshot = nullptr;
+    InitializeObjectAttributes(
+        &oa, keyPath, OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+        nullptr, nullptr);
+    status = ZwOpenKeyEx(&key, KEY_READ, &oa, 0);
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    // The value may grow between sizing the buffer and reading it.
+    for (int i = 0; i < 4; ++i) {
+        if (enumerate) {
+            status = ZwEnumerateValueKey(
+                key, 0, KeyValueFullInformation,
+                info, length, &resultLength);
+        } else {
+            status = ZwQueryValueKey(
+                key, &valueName, KeyValueFullInformation,
+                info, length, &resultLength);
+        }
+
+        if (status != STATUS_BUFFER_OVERFLOW &&
+            status != STATUS_BUFFER_TOO_SMALL) {
+
+            break;
+        }
+
+        if (info) {
+            ExFreePoolWithTag(info, SAR_TAG);
+        }
+
+        length = resultLength;
+        info = (PKEY_VALUE_FULL_INFORMATION)ExAllocatePoolWithTag(
+            PagedPool, length, SAR_TAG);
+
+        if (!info) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto err_out;
+        }
+    }
+
+    if (status == STATUS_OBJECT_NAME_NOT_FOUND ||
+        status == STATUS_NO_MORE_ENTRIES) {
+
+        newSnapshot = (SarRegistryValueSnapshot *)ExAllocatePoolWithTag(
+            NonPagedPool, sizeof(SarRegistryValueSnapshot), SAR_TAG);
+
+        if (!newSnapshot) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto err_out;
+        }
+
+        RtlZeroMemory(newSnapshot, sizeof(SarRegistryValueSnapshot));
+        newSnapshot->status = status;
+    } else if (NT_SUCCESS(status)) {
+        newSnapshot = (SarRegistryValueSnapshot *)ExAllocatePoolWithTag(
+            NonPagedPool,
+            sizeof(SarRegistryValueSnapshot) +
+                info->NameLength + info->DataLength,
+            SAR_TAG);
+
+        if (!newSnapshot) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto err_out;
+        }
+
+        newSnapshot->status = STATUS_SUCCESS;
+        newSnapshot->type = info->Type;
+        newSnapshot->nameLength = info->NameLength;
+        newSnapshot->dataLength = info->DataLength;
+        newSnapshot->name = (PWCH)(newSnapshot + 1);
+        newSnapshot->data = (PUCHAR)newSnapshot->name + info->NameLength;
+        RtlCopyMemory(newSnapshot->name, info->Name, info->NameLength);
+        RtlCopyMemory(
+            newSnapshot->data, (PUCHAR)info + info->DataOffset,
+            info->DataLength);
+    } else {
+        goto err_out;
+    }
+
+    newSnapshot->refs = 1;
+    *snapshot = newSnapshot;
+    status = STATUS_SUCCESS;
+
+err_out:
+    if (info) {
+        ExFreePoolWithTag(info, SAR_TAG);
+    }
+
+    ZwClose(key);
+    return status;
+}
+
+// Returns a referenced snapshot of the redirect target, capturing and
+// publishing a new one if the last was dropped. Returns nullptr if the target
+// can't be read, in which case the query should be let through.
+static SarRegistryValueSnapshot *SarGetRegistrySnapshot(
+    SarDriverExtension *extension,
+    SarRegistryRedirect *redirect,
+    BOOLEAN enumerate)
+{
+    SarRegistryValueSnapshot **slot = enumerate ?
+        &redirect->enumSnapshot : &redirect->querySnapshot;
+    SarRegistryValueSnapshot *snapshot = nullptr;
+    ULONG generation;
+    KIRQL irql;
+    NTSTATUS status;
+    BOOLEAN published = FALSE;
+
+    // Counted before the generation is read, so a write that lands during
+    // the capture can't skip the invalidation that bumps it.
+    InterlockedIncrement(&extension->registrySnapshotCount);
+    irql = ExAcquireSpinLockShared(&extension->registryRedirectLock);
+    snapshot = *slot;
+
+    if (snapshot) {
+        InterlockedIncrement(&snapshot->refs);
+    }
+
+    generation = redirect->generation;
+    ExReleaseSpinLockShared(&extension->registryRedirectLock, irql);
+
+    if (snapshot) {
+        InterlockedDecrement(&extension->registrySnapshotCount);
+        return snapshot;
+    }
+
+    status = SarCaptureRegistrySnapshot(
+        &redirect->target, enumerate, &snapshot);
+
+    if (!NT_SUCCESS(status)) {
+        InterlockedDecrement(&extension->registrySnapshotCount);
+        return nullptr;
+    }
+
+    // If the target changed while we were reading it, or another thread got
+    // there first, answer this query from our copy without publishing it.
+    irql = ExAcquireSpinLockExclusive(&extension->registryRedirectLock);
+
+    if (!*slot && redirect->generation == generation) {
+        InterlockedIncrement(&snapshot->refs);
+        *slot = snapshot;
+        published = TRUE;
+    }
+
+    ExReleaseSpinLockExclusive(&extension->registryRedirectLock, irql);
+
+    if (!published) {
+        InterlockedDecrement(&extension->registrySnapshotCount);
+    }
+
+    return snapshot;
+}
+
+static VOID SarDropRegistrySnapshots(
+    SarDriverExtension *extension,
+    SarRegistryRedirect *redirect)
+{
+    SarRegistryValueSnapshot *querySnapshot, *enumSnapshot;
+    KIRQL irql;
+
+    irql = ExAcquireSpinLockExclusive(&extension->registryRedirectLock);
+    querySnapshot = redirect->querySnapshot;
+    enumSnapshot = redirect->enumSnapshot;
+    redirect->querySnapshot = nullptr;
+    redirect->enumSnapshot = nullptr;
+    redirect->generation++;
+
+    if (querySnapshot) {
+        InterlockedDecrement(&extension->registrySnapshotCount);
+    }
+
+    if (enumSnapshot) {
+        InterlockedDecrement(&extension->registrySnapshotCount);
+    }
+
+    ExReleaseSpinLockExclusive(&extension->registryRedirectLock, irql);
+
+    SarReleaseRegistrySnapshot(querySnapshot);
+    SarReleaseRegistrySnapshot(enumSnapshot);
+}
+
+// Drops the snapshots of every redirect targeting the given key, or of all
+// redirects if the key name couldn't be found.
+static VOID SarInvalidateRegistrySnapshots(
+    SarDriverExtension *extension,
+    PCUNICODE_STRING path)
+{
+    if (path && !SarRegistryPrefilterMayMatch(
+        &extension->registryTargetPrefilter, path)) {
+
+        return;
+    }
+
+    for (ULONG i = 0; i < extension->registryRedirectCount; ++i) {
+        SarRegistryRedirect *redirect = extension->registryRedirects[i];
+
+        if (!path || RtlEqualUnicodeString(path, &redirect->target, TRUE)) {
+            SarDropRegistrySnapshots(extension, redirect);
+        }
+    }
+}
+
+static VOID SarCaptureAllRegistrySnapshots(SarDriverExtension *extension)
+{
+    for (ULONG i = 0; i < extension->registryRedirectCount; ++i) {
+        SarRegistryRedirect *redirect = extension->registryRedirects[i];
+
+        SarReleaseRegistrySnapshot(
+            SarGetRegistrySnapshot(extension, redirect, FALSE));
+        SarReleaseRegistrySnapshot(
+            SarGetRegistrySnapshot(extension, redirect, TRUE));
+    }
+}
+
+// Fills in a KEY_VALUE_*_INFORMATION structure from a snapshot the way the
+// configuration manager would. Returns STATUS_NOT_SUPPORTED for information
+// classes that should be forwarded to the target key instead.
+static NTSTATUS SarCopyRegistrySnapshot(
+    SarRegistryValueSnapshot *snapshot,
+    KEY_VALUE_INFORMATION_CLASS infoClass,
+    PVOID buffer,
+    ULONG length,
+    PULONG resultLength)
+{
+    ULONG fixedLength, dataOffset = 0, requiredLength;
+
+    switch (infoClass) {
+        case KeyValueBasicInformation:
+            fixedLength = FIELD_OFFSET(KEY_VALUE_BASIC_INFORMATION, Name);
+            requiredLength = fixedLength + snapshot->nameLength;
+            break;
+        case KeyValueFullInformation:
+            fixedLength = FIELD_OFFSET(KEY_VALUE_FULL_INFORMATION, Name);
+            dataOffset = (fixedLength + snapshot->nameLength +
+                sizeof(ULONG) - 1) & ~(ULONG)(sizeof(ULONG) - 1);
+            requiredLength = dataOffset + snapshot->dataLength;
+            break;
+        case KeyValuePartialInformation:
+            fixedLength = FIELD_OFFSET(KEY_VALUE_PARTIAL_INFORMATION, Data);
+            requiredLength = fixedLength + snapshot->dataLength;
+            break;
+        default:
+            return STATUS_NOT_SUPPORTED;
+    }
+
+    *resultLength = requiredLength;
+
+    if (length < fixedLength) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    switch (infoClass) {
+        case KeyValueBasicInformation: {
+            PKEY_VALUE_BASIC_INFORMATION info =
+                (PKEY_VALUE_BASIC_INFORMATION)buffer;
+
+            info->TitleIndex = 0;
+            info->Type = snapshot->type;
+            info->NameLength = snapshot->nameLength;
+
+            if (length < requiredLength) {
+                return STATUS_BUFFER_OVERFLOW;
+            }
+
+            RtlCopyMemory(info->Name, snapshot->name, snapshot->nameLength);
+            break;
+        }
+        case KeyValueFullInformation: {
+            PKEY_VALUE_FULL_INFORMATION info =
+                (PKEY_VALUE_FULL_INFORMATION)buffer;
+
+            info->TitleIndex = 0;
+            info->Type = snapshot->type;
+            info->DataOffset = dataOffset;
+            info->DataLength = snapshot->dataLength;
+            info->NameLength = snapshot->nameLength;
+
+            if (length < requiredLength) {
+                return STATUS_BUFFER_OVERFLOW;
+            }
+
+            RtlCopyMemory(info->Name, snapshot->name, snapshot->nameLength);
+            RtlCopyMemory(
+                (PUCHAR)buffer + dataOffset, snapshot->data,
+                snapshot->dataLength);
+            break;
+        }
+        case KeyValuePartialInformation: {
+            PKEY_VALUE_PARTIAL_INFORMATION info =
+                (PKEY_VALUE_PARTIAL_INFORMATION)buffer;
+
+            info->TitleIndex = 0;
+            info->Type = snapshot->type;
+            info->DataLength = snapshot->dataLength;
+
+            if (length < requiredLength) {
+                return STATUS_BUFFER_OVERFLOW;
+            }
+
+            RtlCopyMemory(info->Data, snapshot->data, snapshot->dataLength);
+            break;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Answers a matched query from the redirect target's snapshot. Returns
+// STATUS_NOT_SUPPORTED if the query has to go to the target key instead.
+static NTSTATUS SarFilterFromSnapshot(
+    SarDriverExtension *extension,
+    SarRegistryRedirect *redirect,
+    BOOLEAN enumerate,
+    KEY_VALUE_INFORMATION_CLASS infoClass,
+    PVOID buffer,
+    ULONG length,
+    PULONG resultLength)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    SarRegistryValueSnapshot *snapshot;
+    ULONG snapshotLength = 0;
+
+    if (infoClass != KeyValueBasicInformation &&
+        infoClass != KeyValueFullInformation &&
+        infoClass != KeyValuePartialInformation) {
+
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    snapshot = SarGetRegistrySnapshot(extension, redirect, enumerate);
+
+    if (!snapshot) {
+        return STATUS_SUCCESS;
+    }
+
+    __try {
+        if (NT_SUCCESS(snapshot->status)) {
+            status = SarCopyRegistrySnapshot(
+                snapshot, infoClass, buffer, length, &snapshotLength);
+        } else {
+            status = snapshot->status;
+        }
+
+        *resultLength = snapshotLength;
+
+        if (NT_SUCCESS(status)) {
+            status = STATUS_CALLBACK_BYPASS;
+        }
+    } __except(EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+    }
+
+    SarReleaseRegistrySnapshot(snapshot);
+    return status;
+}
+
 NTSTATUS SarFilterMMDeviceQuery(
+    SarDriverExtension *extension,
     PREG_QUERY_VALUE_KEY_INFORMATION queryInfo,
-    PUNICODE_STRING wrapperRegistrationPath)
+    SarRegistryRedirect *redirect)
 {
     NTSTATUS status = STATUS_SUCCESS;
     OBJECT_ATTRIBUTES oa;
@@ -793,8 +1328,19 @@ NTSTATUS SarFilterMMDeviceQuery(
     UNICODE_STRING valueName = {};
     PVOID buffer = nullptr;
 
+    status = SarFilterFromSnapshot(
+        extension, redirect, FALSE,
+        queryInfo->KeyValueInformationClass,
+        queryInfo->KeyValueInformation,
+        queryInfo->Length,
+        queryInfo->ResultLength);
+
+    if (status != STATUS_NOT_SUPPORTED) {
+        return status;
+    }
+
     InitializeObjectAttributes(
-        &oa, wrapperRegistrationPath, OBJ_KERNEL_HANDLE,
+        &oa, &redirect->target, OBJ_KERNEL_HANDLE,
         nullptr, nullptr);
     status = ZwOpenKeyEx(&wrapperKey, KEY_ALL_ACCESS, &oa, 0);
 
@@ -836,18 +1382,30 @@ NTSTATUS SarFilterMMDeviceQuery(
 }
 
 NTSTATUS SarFilterMMDeviceEnum(
+    SarDriverExtension *extension,
     PREG_ENUMERATE_VALUE_KEY_INFORMATION queryInfo,
-    PUNICODE_STRING wrapperRegistrationPath)
+    SarRegistryRedirect *redirect)
 {
     NTSTATUS status = STATUS_SUCCESS;
     OBJECT_ATTRIBUTES oa;
     HANDLE wrapperKey;
     ULONG resultLength = 0;
-    UNICODE_STRING valueName = {};
     PVOID buffer = nullptr;
 
+    // Only index 0 gets here, which is what the enum snapshot holds.
+    status = SarFilterFromSnapshot(
+        extension, redirect, TRUE,
+        queryInfo->KeyValueInformationClass,
+        queryInfo->KeyValueInformation,
+        queryInfo->Length,
+        queryInfo->ResultLength);
+
+    if (status != STATUS_NOT_SUPPORTED) {
+        return status;
+    }
+
     InitializeObjectAttributes(
-        &oa, wrapperRegistrationPath, OBJ_KERNEL_HANDLE,
+        &oa, &redirect->target, OBJ_KERNEL_HANDLE,
         nullptr, nullptr);
     status = ZwOpenKeyEx(&wrapperKey, KEY_ALL_ACCESS, &oa, 0);
 
@@ -896,7 +1454,7 @@ NTSTATUS SarRegistryCallback(PVOID context, PVOID argument1, PVOID argument2)
 {
     UNREFERENCED_PARAMETER(argument2);
 
-    UNICODE_STRING redirectPath;
+    SarRegistryRedirect *redirect;
     NTSTATUS status;
     REG_NOTIFY_CLASS notifyClass = (REG_NOTIFY_CLASS)(ULONG_PTR)argument1;
     SarDriverExtension *extension = (SarDriverExtension *)context;
@@ -920,7 +1478,7 @@ NTSTATUS SarRegistryCallback(PVOID context, PVOID argument1, PVOID argument2)
                 break;
             }
 
-            if (!SarFilterMatchesPath(extension, objectName, &redirectPath)) {
+            if (!SarFilterMatchesPath(extension, objectName, &redirect)) {
                 break;
             }
 
@@ -928,7 +1486,7 @@ NTSTATUS SarRegistryCallback(PVOID context, PVOID argument1, PVOID argument2)
                 break;
             }
 
-            return SarFilterMMDeviceQuery(queryInfo, &redirectPath);
+            return SarFilterMMDeviceQuery(extension, queryInfo, redirect);
         }
         case RegNtEnumerateValueKey: {
             PREG_ENUMERATE_VALUE_KEY_INFORMATION queryInfo =
@@ -947,7 +1505,7 @@ NTSTATUS SarRegistryCallback(PVOID context, PVOID argument1, PVOID argument2)
                 break;
             }
 
-            if (!SarFilterMatchesPath(extension, objectName, &redirectPath)) {
+            if (!SarFilterMatchesPath(extension, objectName, &redirect)) {
                 break;
             }
 
@@ -955,7 +1513,35 @@ NTSTATUS SarRegistryCallback(PVOID context, PVOID argument1, PVOID argument2)
                 break;
             }
 
-            return SarFilterMMDeviceEnum(queryInfo, &redirectPath);
+            return SarFilterMMDeviceEnum(extension, queryInfo, redirect);
+        }
+        case RegNtPostSetValueKey:
+        case RegNtPostDeleteValueKey:
+        case RegNtPostDeleteKey: {
+            PREG_POST_OPERATION_INFORMATION postInfo =
+                (PREG_POST_OPERATION_INFORMATION)argument2;
+            PCUNICODE_STRING objectName = nullptr;
+
+            if (!postInfo || !NT_SUCCESS(postInfo->Status) ||
+                !postInfo->Object) {
+
+                break;
+            }
+
+            // Most registry writes in the system land here, so don't pay
+            // for the name lookup unless there's a snapshot to drop.
+            if (!extension->registrySnapshotCount) {
+                break;
+            }
+
+            // A deleted key may no longer have a name to look up, in which
+            // case every snapshot is dropped.
+            status = CmCallbackGetKeyObjectID(
+                &extension->filterCookie, postInfo->Object,
+                nullptr, &objectName);
+            SarInvalidateRegistrySnapshots(
+                extension, NT_SUCCESS(status) ? objectName : nullptr);
+            break;
         }
     }
 
@@ -964,55 +1550,80 @@ NTSTATUS SarRegistryCallback(PVOID context, PVOID argument1, PVOID argument2)
 
 static void SarDeleteRegistryRedirect(PVOID ptr)
 {
-    PUNICODE_STRING str = (PUNICODE_STRING)ptr;
+    SarRegistryRedirect *redirect = (SarRegistryRedirect *)ptr;
 
-    if (str->Buffer) {
-        SarStringFree(str);
+    SarReleaseRegistrySnapshot(redirect->querySnapshot);
+    SarReleaseRegistrySnapshot(redirect->enumSnapshot);
+
+    if (redirect->target.Buffer) {
+        SarStringFree(&redirect->target);
     }
 
-    ExFreePoolWithTag(str, SAR_TAG);
+    ExFreePoolWithTag(redirect, SAR_TAG);
 }
 
 static NTSTATUS SarAddRegistryRedirect(
-    PRTL_AVL_TABLE table, NTSTRSAFE_PCWSTR src, NTSTRSAFE_PCWSTR dst)
+    SarDriverExtension *extension,
+    PRTL_AVL_TABLE table, SarRegistryPrefilter *prefilter,
+    NTSTRSAFE_PCWSTR src, NTSTRSAFE_PCWSTR dst)
 {
     NTSTATUS status = STATUS_SUCCESS;
     UNICODE_STRING srcLocal = {}, dstLocal = {};
-    PUNICODE_STRING dstHeap = nullptr;
+    SarRegistryRedirect *redirect = nullptr;
 
     RtlUnicodeStringInit(&srcLocal, src);
     RtlUnicodeStringInit(&dstLocal, dst);
 
-    dstHeap = (PUNICODE_STRING)ExAllocatePoolWithTag(
-        NonPagedPool, sizeof(UNICODE_STRING), SAR_TAG);
+    if (extension->registryRedirectCount >= SAR_MAX_REGISTRY_REDIRECTS) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err;
+    }
+
+    redirect = (SarRegistryRedirect *)ExAllocatePoolWithTag(
+        NonPagedPool, sizeof(SarRegistryRedirect), SAR_TAG);
 
-    if (!dstHeap) {
+    if (!redirect) {
         status = STATUS_INSUFFICIENT_RESOURCES;
         goto err;
     }
 
-    RtlZeroMemory(dstHeap, sizeof(UNICODE_STRING));
-    status = SarStringDuplicate(dstHeap, &dstLocal);
+    RtlZeroMemory(redirect, sizeof(SarRegistryRedirect));
+    status = SarStringDuplicate(&redirect->target, &dstLocal);
+
+    if (!NT_SUCCESS(status)) {
+        goto err;
+    }
+
+    status = SarAddRegistryPrefilterEntry(prefilter, &srcLocal);
+
+    if (!NT_SUCCESS(status)) {
+        goto err;
+    }
+
+    status = SarAddRegistryPrefilterEntry(
+        &extension->registryTargetPrefilter, &dstLocal);
 
     if (!NT_SUCCESS(status)) {
         goto err;
     }
 
-    status = SarInsertStringTableEntry(table, &srcLocal, dstHeap);
+    status = SarInsertStringTableEntry(table, &srcLocal, redirect);
 
     if (!NT_SUCCESS(status)) {
         goto err;
     }
 
+    extension->registryRedirects[extension->registryRedirectCount++] =
+        redirect;
     return STATUS_SUCCESS;
 
 err:
-    if (dstHeap) {
-        if (dstHeap->Buffer) {
-            SarStringFree(dstHeap);
+    if (redirect) {
+        if (redirect->target.Buffer) {
+            SarStringFree(&redirect->target);
         }
 
-        ExFreePoolWithTag(dstHeap, SAR_TAG);
+        ExFreePoolWithTag(redirect, SAR_TAG);
     }
 
     return status;
@@ -1020,7 +1631,7 @@ err:
 
 #define REDIRECT_INPROC_WOW64(src, dst) \
     do { \
-        status = SarAddRegistryRedirect(wow64, \
+        status = SarAddRegistryRedirect(extension, wow64, wow64Prefilter, \
             WOW64_CLSID_ROOT src L"\\InprocServer32", \
             WOW64_CLSID_ROOT dst L"\\InprocServer32"); \
         if (!NT_SUCCESS(status)) { \
@@ -1029,7 +1640,7 @@ err:
     } while (0)
 #define REDIRECT_INPROC(src, dst) \
     do { \
-        status = SarAddRegistryRedirect(table, \
+        status = SarAddRegistryRedirect(extension, table, prefilter, \
             CLSID_ROOT src L"\\InprocServer32", \
             CLSID_ROOT dst L"\\InprocServer32"); \
         if (!NT_SUCCESS(status)) { \
@@ -1048,6 +1659,8 @@ static NTSTATUS SarAddAllRegistryRedirects(SarDriverExtension *extension)
     PVOID p;
     PRTL_AVL_TABLE wow64 = &extension->registryRedirectTableWow64;
     PRTL_AVL_TABLE table = &extension->registryRedirectTable;
+    SarRegistryPrefilter *wow64Prefilter = &extension->registryPrefilterWow64;
+    SarRegistryPrefilter *prefilter = &extension->registryPrefilter;
 
     // MMDeviceEnumerator
     REDIRECT(
@@ -1065,7 +1678,8 @@ static NTSTATUS SarAddAllRegistryRedirects(SarDriverExtension *extension)
         SarStringTableEntry *entry = (SarStringTableEntry *)p;
         UNREFERENCED_PARAMETER(entry);
 
-        SAR_DEBUG("Registry mapping: %wZ -> %wZ", &entry->key, entry->value);
+        SAR_DEBUG("Registry mapping: %wZ -> %wZ", &entry->key,
+            &((SarRegistryRedirect *)entry->value)->target);
     }
 
     for (p = RtlEnumerateGenericTableAvl(wow64, TRUE); p;
@@ -1075,7 +1689,7 @@ static NTSTATUS SarAddAllRegistryRedirects(SarDriverExtension *extension)
         UNREFERENCED_PARAMETER(entry);
 
         SAR_DEBUG("WOW64 Registry mapping: %wZ -> %wZ",
-            &entry->key, entry->value);
+            &entry->key, &((SarRegistryRedirect *)entry->value)->target);
     }
 
     return STATUS_SUCCESS;
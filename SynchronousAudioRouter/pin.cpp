@@ -173,20 +173,49 @@ NTSTATUS SarKsPinCreate(PKSPIN pin, PIRP irp)
     return status;
 }
 
-NTSTATUS SarGetOrCreateEndpointProcessContext(
-    SarEndpoint *endpoint,
-    PEPROCESS process,
+static ULONG SarProcessContextHash(PEPROCESS process)
+{
+    return ((ULONG)((ULONG_PTR)process >> 4) * 2654435761u) >>
+        (32 - SAR_PROCESS_CONTEXT_TABLE_BITS);
+}
+
+// Lock-free lookup. Table slots are only ever filled in under the endpoint
+// mutex and cleared all at once when the pin closes, so an empty slot ends
+// the probe sequence. Returns FALSE if the table is full and the caller has
+// to fall back to scanning the list.
+static BOOLEAN SarLookupEndpointProcessContext(
+    SarEndpoint *endpoint, PEPROCESS process,
     SarEndpointProcessContext **outContext)
 {
-    NTSTATUS status;
-    SarEndpointProcessContext *newContext = nullptr;
-    SIZE_T viewSize = SAR_BUFFER_CELL_SIZE;
-    LARGE_INTEGER registerFileOffset = {};
+    ULONG hash = SarProcessContextHash(process);
 
-    ExAcquireFastMutex(&endpoint->mutex);
+    *outContext = nullptr;
+
+    for (ULONG i = 0; i < SAR_PROCESS_CONTEXT_TABLE_SIZE; ++i) {
+        SarEndpointProcessContext *context = (SarEndpointProcessContext *)
+            InterlockedCompareExchangePointer((PVOID *)
+                &endpoint->processContextTable[
+                    (hash + i) & (SAR_PROCESS_CONTEXT_TABLE_SIZE - 1)],
+                nullptr, nullptr);
+
+        if (!context) {
+            return TRUE;
+        }
 
+        if (context->process == process) {
+            *outContext = context;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+// Must be called with the endpoint mutex held.
+static SarEndpointProcessContext *SarFindEndpointProcessContextLocked(
+    SarEndpoint *endpoint, PEPROCESS process)
+{
     PLIST_ENTRY entry = endpoint->activeProcessList.Flink;
-    SarEndpointProcessContext *foundContext = nullptr;
 
     while (entry != &endpoint->activeProcessList) {
         SarEndpointProcessContext *existingContext =
@@ -194,12 +223,50 @@ NTSTATUS SarGetOrCreateEndpointProcessContext(
         entry = entry->Flink;
 
         if (existingContext->process == process) {
-            foundContext = existingContext;
-            break;
+            return existingContext;
         }
     }
 
-    ExReleaseFastMutex(&endpoint->mutex);
+    return nullptr;
+}
+
+// Must be called with the endpoint mutex held.
+static VOID SarInsertEndpointProcessContextLocked(
+    SarEndpoint *endpoint, SarEndpointProcessContext *context)
+{
+    ULONG hash = SarProcessContextHash(context->process);
+
+    InsertHeadList(&endpoint->activeProcessList, &context->listEntry);
+
+    for (ULONG i = 0; i < SAR_PROCESS_CONTEXT_TABLE_SIZE; ++i) {
+        ULONG slot = (hash + i) & (SAR_PROCESS_CONTEXT_TABLE_SIZE - 1);
+
+        if (!endpoint->processContextTable[slot]) {
+            InterlockedExchangePointer(
+                (PVOID *)&endpoint->processContextTable[slot], context);
+            return;
+        }
+    }
+
+    // Table full, the context is only reachable through the list.
+}
+
+NTSTATUS SarGetOrCreateEndpointProcessContext(
+    SarEndpoint *endpoint,
+    PEPROCESS process,
+    SarEndpointProcessContext **outContext)
+{
+    NTSTATUS status;
+    SarEndpointProcessContext *newContext = nullptr;
+    SarEndpointProcessContext *foundContext = nullptr;
+    SIZE_T viewSize = SAR_BUFFER_CELL_SIZE;
+    LARGE_INTEGER registerFileOffset = {};
+
+    if (!SarLookupEndpointProcessContext(endpoint, process, &foundContext)) {
+        ExAcquireFastMutex(&endpoint->mutex);
+        foundContext = SarFindEndpointProcessContextLocked(endpoint, process);
+        ExReleaseFastMutex(&endpoint->mutex);
+    }
 
     if (foundContext) {
         if (outContext) {
@@ -240,9 +307,22 @@ NTSTATUS SarGetOrCreateEndpointProcessContext(
     }
 
     ExAcquireFastMutex(&endpoint->mutex);
-    InsertHeadList(&endpoint->activeProcessList, &newContext->listEntry);
+
+    // Another thread of the same process may have won the race to create
+    // the context while we were mapping.
+    foundContext = SarFindEndpointProcessContextLocked(endpoint, process);
+
+    if (!foundContext) {
+        SarInsertEndpointProcessContextLocked(endpoint, newContext);
+    }
+
     ExReleaseFastMutex(&endpoint->mutex);
 
+    if (foundContext) {
+        SarDeleteEndpointProcessContext(newContext);
+        newContext = foundContext;
+    }
+
     if (outContext) {
         *outContext = newContext;
     }
@@ -284,6 +364,11 @@ NTSTATUS SarKsPinClose(PKSPIN pin, PIRP irp)
     InitializeListHead(&toRemoveList);
     ExAcquireFastMutex(&endpoint->mutex);
 
+    for (ULONG i = 0; i < SAR_PROCESS_CONTEXT_TABLE_SIZE; ++i) {
+        InterlockedExchangePointer(
+            (PVOID *)&endpoint->processContextTable[i], nullptr);
+    }
+
     if (!IsListEmpty(&endpoint->activeProcessList)) {
         PLIST_ENTRY entry = endpoint->activeProcessList.Flink;
 
@@ -445,6 +530,7 @@ NTSTATUS SarKsPinSetDeviceState(PKSPIN pin, KSSTATE toState, KSSTATE fromState)
 
         if (resetPosition) {
             regs.positionRegister = 0;
+            regs.clockRegister = 0;
         }
 
         status = SarWriteEndpointRegisters(&regs, endpoint);
@@ -748,7 +834,7 @@ NTSTATUS SarKsPinProposeDataFormat(
          endpoint->owner->sampleSize * 8) ||
         format->WaveFormatExt.Format.wFormatTag != WAVE_FORMAT_EXTENSIBLE ||
         (format->WaveFormatExt.Format.nSamplesPerSec !=
-         endpoint->owner->sampleRate) ||
+         endpoint->sampleRate) ||
         format->WaveFormatExt.SubFormat != KSDATAFORMAT_SUBTYPE_PCM) {
         SAR_DEBUG("WAVE Format type can't be handled: "
                 "channels: %d, bitsPerSample: %d, formatTag: 0x%x, samplesPerSec: %d, subFormat: " GUID_FORMAT,
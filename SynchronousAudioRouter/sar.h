@@ -62,6 +62,12 @@ DEFINE_GUID(GUID_DEVINTERFACE_SYNCHRONOUSAUDIOROUTER,
     FILE_DEVICE_UNKNOWN, 4, METHOD_NEITHER, FILE_READ_DATA | FILE_WRITE_DATA)
 #define SAR_SEND_FORMAT_CHANGE_EVENT CTL_CODE( \
     FILE_DEVICE_UNKNOWN, 5, METHOD_NEITHER, FILE_READ_DATA | FILE_WRITE_DATA)
+#define SAR_REMOVE_ENDPOINT CTL_CODE( \
+    FILE_DEVICE_UNKNOWN, 6, METHOD_NEITHER, FILE_READ_DATA | FILE_WRITE_DATA)
+// Input is a packed array of SarCreateEndpointRequest. Completes once every
+// endpoint in it has been set up, with the first failure if any failed.
+#define SAR_CREATE_ENDPOINTS CTL_CODE( \
+    FILE_DEVICE_UNKNOWN, 7, METHOD_NEITHER, FILE_READ_DATA | FILE_WRITE_DATA)
 
 // SarNdis ioctls
 #define SARNDIS_IOCTL_CODE(i) CTL_CODE( \
@@ -78,18 +84,29 @@ DEFINE_GUID(GUID_DEVINTERFACE_SYNCHRONOUSAUDIOROUTER,
 #define SAR_MAX_SAMPLE_RATE 192000
 #define SAR_MAX_CHANNEL_COUNT 32
 #define SAR_BUFFER_CELL_SIZE 65536
+#define SAR_CLOCK_REGISTER_OFFSET \
+    (SAR_BUFFER_CELL_SIZE - sizeof(SarClockRegisters))
 #define SAR_MAX_ENDPOINT_COUNT \
-    (SAR_BUFFER_CELL_SIZE / sizeof(SarEndpointRegisters))
+    (SAR_CLOCK_REGISTER_OFFSET / sizeof(SarEndpointRegisters))
 
 typedef struct SarCreateEndpointRequest
 {
     DWORD type;
     DWORD index;
     DWORD channelCount;
+    DWORD sampleRate; // 0 for the rate set with SAR_SET_BUFFER_LAYOUT
     WCHAR id[MAX_ENDPOINT_NAME_LENGTH+1];
     WCHAR name[MAX_ENDPOINT_NAME_LENGTH+1];
 } SarCreateEndpointRequest;
 
+// Removed endpoints are orphaned, and their streams may keep writing the
+// endpoint's registers until they close, so clients must not give the same
+// register index to a new endpoint.
+typedef struct SarRemoveEndpointRequest
+{
+    DWORD index;
+} SarRemoveEndpointRequest;
+
 typedef struct SarSetBufferLayoutRequest
 {
     DWORD bufferSize;
@@ -106,6 +123,9 @@ typedef struct SarSetBufferLayoutResponse
     DWORD registerBase;
 } SarSetBufferLayoutResponse;
 
+// Maximum number of handles the client collects per SAR_WAIT_HANDLE_QUEUE.
+#define SAR_HANDLE_QUEUE_BATCH_SIZE 128
+
 typedef struct SarHandleQueueResponse
 {
     PVOID64 handle;
@@ -120,13 +140,30 @@ typedef struct SarEndpointRegisters
 {
     ULONG generation;
     DWORD positionRegister;
-    DWORD reserved; //clockRegister;
+    DWORD clockRegister;
     DWORD bufferOffset;
     DWORD bufferSize;
     DWORD notificationCount;
     DWORD activeChannelCount;
 } SarEndpointRegisters;
 
+// Smoothed model of the ASIO tick timeline, published by the client at the
+// end of the register cell. All times are in performance counter units. The
+// sequence is odd while the client publishes the clock together with the
+// endpoint clock registers it advanced that tick, so readers must retry until
+// they observe the same even value before and after reading.
+typedef struct SarClockRegisters
+{
+    ULONG sequence;
+    DWORD periodFrames;
+    ULONG64 tickCount;
+    LONG64 tickTime;
+    LONG64 nextTickTime;
+    ULONG64 periodTime; // 32.32 fixed point
+    DWORD jitterRms;
+    DWORD jitterMax;
+} SarClockRegisters;
+
 typedef struct SarNdisEnumerateResponseItem
 {
     ULONG32 nameOffset;
@@ -163,27 +200,30 @@ typedef struct SarNdisEnumerateResponse
     DbgPrintEx(DPFLTR_DEFAULT_ID, DPFLTR_TRACE_LEVEL, __FUNCTION__ " (SAR) " fmt "\n", __VA_ARGS__)
 #endif
 
-typedef struct SarHandleQueue
-{
-    KSPIN_LOCK lock;
-    LIST_ENTRY pendingItems;
-    LIST_ENTRY pendingIrps;
-} SarHandleQueue;
+#define SAR_HANDLE_QUEUE_CAPACITY 256
 
-typedef struct SarHandleQueueItem
+typedef struct SarHandleQueueSlot
 {
-    LIST_ENTRY listEntry;
+    volatile LONG sequence;
     HANDLE kernelProcessHandle;
     HANDLE userHandle;
     ULONG64 associatedData;
-} SarHandleQueueItem;
-
-typedef struct SarHandleQueueIrp
+} SarHandleQueueSlot;
+
+// Bounded ring of handles waiting to be passed to the client. Producers
+// (notification event registrations) claim slots with an interlocked
+// increment of the tail and publish them through the slot sequence, so
+// posting never allocates or takes a lock. The single consumer side, draining
+// into the client's wait IRP, is serialized by drainMutex. The parked wait
+// IRP is owned by whoever manages to swap it out of pendingIrp.
+typedef struct SarHandleQueue
 {
-    LIST_ENTRY listEntry;
-    HANDLE kernelProcessHandle;
-    PIRP irp;
-} SarHandleQueueIrp;
+    FAST_MUTEX drainMutex;
+    PIRP volatile pendingIrp;
+    volatile LONG head;
+    volatile LONG tail;
+    SarHandleQueueSlot slots[SAR_HANDLE_QUEUE_CAPACITY];
+} SarHandleQueue;
 
 typedef struct SarTableEntry
 {
@@ -197,6 +237,55 @@ typedef struct SarStringTableEntry
     PVOID value;
 } SarStringTableEntry;
 
+#define SAR_MAX_REGISTRY_REDIRECTS 8
+
+// Negative filter over the keys of a registry redirect table. Keys are
+// rejected on length and case-insensitive hash before the exact lookup, which
+// needs a nonpaged copy of the key and the redirect lock. Built once before
+// the registry callback is registered and read-only afterwards.
+typedef struct SarRegistryPrefilter
+{
+    ULONG count;
+    ULONG64 bloom;
+    USHORT lengths[SAR_MAX_REGISTRY_REDIRECTS];
+    ULONG hashes[SAR_MAX_REGISTRY_REDIRECTS];
+} SarRegistryPrefilter;
+
+// Copy of a value on a redirect target, used to answer matched queries
+// without touching the registry. Immutable once published and freed when the
+// last reference is dropped. A failed status (value not found) is replayed to
+// the caller as is.
+typedef struct SarRegistryValueSnapshot
+{
+    volatile LONG refs;
+    NTSTATUS status;
+    ULONG type;
+    ULONG nameLength;
+    ULONG dataLength;
+    PWCH name;
+    PUCHAR data;
+} SarRegistryValueSnapshot;
+
+// Value of the registry redirect tables. The snapshots are guarded by
+// registryRedirectLock and dropped when the target key changes; generation
+// is bumped on every drop so a capture racing with it isn't published.
+typedef struct SarRegistryRedirect
+{
+    UNICODE_STRING target;
+    ULONG generation;
+    SarRegistryValueSnapshot *querySnapshot; // default value
+    SarRegistryValueSnapshot *enumSnapshot; // value at index 0
+} SarRegistryRedirect;
+
+#define SAR_PROCESS_VERDICT_CACHE_SIZE 64
+
+// Whether a process runs as the user that started the registry filter.
+typedef struct SarProcessVerdict
+{
+    HANDLE processId;
+    BOOLEAN isMatch;
+} SarProcessVerdict;
+
 typedef struct SarDriverExtension
 {
     PDRIVER_DISPATCH ksDispatchCreate;
@@ -217,8 +306,25 @@ typedef struct SarDriverExtension
     EX_SPIN_LOCK registryRedirectLock;
     RTL_AVL_TABLE registryRedirectTableWow64;
     RTL_AVL_TABLE registryRedirectTable;
+    SarRegistryPrefilter registryPrefilterWow64;
+    SarRegistryPrefilter registryPrefilter;
+    // All redirects by target, to find the snapshots a registry write makes
+    // stale.
+    SarRegistryPrefilter registryTargetPrefilter;
+    SarRegistryRedirect *registryRedirects[SAR_MAX_REGISTRY_REDIRECTS];
+    ULONG registryRedirectCount;
+    // Published snapshots plus captures in flight. While it's zero there is
+    // nothing a registry write could make stale, so the write callbacks
+    // return before looking up the key name.
+    volatile LONG registrySnapshotCount;
     LARGE_INTEGER filterCookie;
     PTOKEN_USER filterUser;
+    // Direct mapped cache of SarFilterMatchesCurrentProcess results keyed by
+    // process id. Entries are dropped by the process notify routine when the
+    // process exits, before its id can be reused.
+    EX_SPIN_LOCK processVerdictLock;
+    SarProcessVerdict processVerdicts[SAR_PROCESS_VERDICT_CACHE_SIZE];
+    BOOLEAN processNotifyRegistered;
 } SarDriverExtension;
 
 typedef struct SarControlContext
@@ -233,6 +339,9 @@ typedef struct SarControlContext
     LIST_ENTRY pendingEndpointList;  // List<SarEndpoint> Endpoints created but not configured
     HANDLE bufferSection;
     PVOID sectionViewBaseAddress;
+    PVOID bufferSectionObject;
+    PVOID systemViewBaseAddress; // System space view of bufferSection
+    SarEndpointRegisters *registerFile; // Register cell in the system view
     SarHandleQueue handleQueue;
     RTL_BITMAP bufferMap;
     PULONG bufferMapStorage;
@@ -249,6 +358,13 @@ typedef struct SarControlContext
     SarBufferMapEntryCount(bufferSize) / sizeof(DWORD) + \
     (((SarBufferMapEntryCount(bufferSize) % sizeof(DWORD)) != 0) ? 1 : 0)))
 
+#define SAR_PROCESS_CONTEXT_TABLE_BITS 5
+#define SAR_PROCESS_CONTEXT_TABLE_SIZE (1 << SAR_PROCESS_CONTEXT_TABLE_BITS)
+
+// How long a clock reader spins on an odd sequence before settling for the
+// endpoint's last consistent snapshot.
+#define SAR_CLOCK_READ_SPINS 4096
+
 typedef struct SarEndpointProcessContext
 {
     LIST_ENTRY listEntry;
@@ -258,11 +374,21 @@ typedef struct SarEndpointProcessContext
     PVOID bufferUVA;
 } SarEndpointProcessContext;
 
+// Tracks the endpoints of one SAR_CREATE_ENDPOINTS request still waiting
+// for SarProcessPendingEndpoints. Protected by the control context mutex.
+typedef struct SarPendingEndpointBatch
+{
+    PIRP irp;
+    LONG remaining;
+    NTSTATUS status;
+} SarPendingEndpointBatch;
+
 typedef struct SarEndpoint
 {
     LONG refs;
     LIST_ENTRY listEntry;
     PIRP pendingIrp;
+    SarPendingEndpointBatch *pendingBatch; // Until the whole batch is done
     UNICODE_STRING deviceName;
     UNICODE_STRING deviceId;
     UNICODE_STRING deviceIdMangled;
@@ -277,6 +403,11 @@ typedef struct SarEndpoint
     DWORD channelCount;
     ULONG channelMask;
     DWORD activeChannelCount;
+    // The rate the endpoint's streams run at, and the most bytes per channel
+    // the client moves in one tick at that rate. These only differ from the
+    // owner's when the client converts the endpoint's rate.
+    DWORD sampleRate;
+    DWORD periodSizeBytes;
 
     FAST_MUTEX mutex;
     BOOLEAN orphan;
@@ -285,6 +416,16 @@ typedef struct SarEndpoint
     SIZE_T activeViewSize;
     ULONG activeBufferSize;
     LIST_ENTRY activeProcessList;
+    // Open addressed index over activeProcessList keyed by EPROCESS, so the
+    // register and buffer paths can find their process context without
+    // taking the mutex.
+    SarEndpointProcessContext *volatile
+        processContextTable[SAR_PROCESS_CONTEXT_TABLE_SIZE];
+
+    // Last consistent clock read, under mutex.
+    BOOLEAN hasLastClock;
+    SarClockRegisters lastClock;
+    SarEndpointRegisters lastClockRegisters;
 } SarEndpoint;
 
 typedef struct SarNdisDriverState
@@ -316,6 +457,15 @@ NTSTATUS SarCreateEndpoint(
     PIRP irp,
     SarControlContext *controlContext,
     SarCreateEndpointRequest *request);
+NTSTATUS SarCreateEndpoints(
+    PDEVICE_OBJECT device,
+    PIRP irp,
+    SarControlContext *controlContext,
+    SarCreateEndpointRequest *requests,
+    ULONG requestCount);
+NTSTATUS SarRemoveEndpoint(
+    SarControlContext *controlContext,
+    SarRemoveEndpointRequest *request);
 VOID SarOrphanEndpoint(SarEndpoint *endpoint);
 VOID SarDeleteEndpoint(SarEndpoint *endpoint);
 NTSTATUS SarSendFormatChangeEvent(
@@ -486,6 +636,12 @@ NTSTATUS SarReadEndpointRegisters(
     SarEndpointRegisters *regs, SarEndpoint *endpoint);
 NTSTATUS SarWriteEndpointRegisters(
     SarEndpointRegisters *regs, SarEndpoint *endpoint);
+// Reads a consistent snapshot of the published clock model together with the
+// endpoint's registers. Fails with STATUS_DEVICE_BUSY if the client keeps
+// updating the clock while we're reading it.
+NTSTATUS SarReadClockRegisters(
+    SarClockRegisters *clock, SarEndpointRegisters *regs,
+    SarEndpoint *endpoint);
 
 NTSTATUS SarStringDuplicate(PUNICODE_STRING str, PCUNICODE_STRING src);
 
@@ -512,6 +668,11 @@ PVOID SarGetStringTableEntry(PRTL_AVL_TABLE table, PCUNICODE_STRING key);
 VOID SarInitializeStringTable(PRTL_AVL_TABLE table);
 VOID SarClearStringTable(PRTL_AVL_TABLE table, VOID (*freeCb)(PVOID));
 
+NTSTATUS SarAddRegistryPrefilterEntry(
+    SarRegistryPrefilter *prefilter, PCUNICODE_STRING key);
+BOOLEAN SarRegistryPrefilterMayMatch(
+    SarRegistryPrefilter *prefilter, PCUNICODE_STRING key);
+
 NTSTATUS SarCopyProcessUser(PEPROCESS process, PTOKEN_USER *outTokenUser);
 
 #endif // KERNEL
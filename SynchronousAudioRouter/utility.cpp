@@ -126,60 +126,97 @@ NTSTATUS SarStringDuplicate(PUNICODE_STRING str, PCUNICODE_STRING src)
 NTSTATUS SarReadEndpointRegisters(
     SarEndpointRegisters *regs, SarEndpoint *endpoint)
 {
-    SarEndpointProcessContext *context;
-    NTSTATUS status;
-
-    status = SarGetOrCreateEndpointProcessContext(
-        endpoint, PsGetCurrentProcess(), &context);
+    SarEndpointRegisters *source;
 
-    if (!NT_SUCCESS(status)) {
-        return status;
-    }
-
-    __try {
-        SarEndpointRegisters *source =
-            &context->registerFileUVA[endpoint->index];
-
-        ProbeForRead(
-            source, sizeof(SarEndpointRegisters), TYPE_ALIGNMENT(ULONG));
-        RtlCopyMemory(regs, source, sizeof(SarEndpointRegisters));
-    } __except(EXCEPTION_EXECUTE_HANDLER) {
-        return GetExceptionCode();
+    if (!endpoint->owner->registerFile) {
+        return STATUS_INVALID_DEVICE_STATE;
     }
 
+    source = &endpoint->owner->registerFile[endpoint->index];
+    regs->generation = *(volatile ULONG *)&source->generation;
+    MemoryBarrier();
+    regs->positionRegister = source->positionRegister;
+    regs->clockRegister = source->clockRegister;
+    regs->bufferOffset = source->bufferOffset;
+    regs->bufferSize = source->bufferSize;
+    regs->notificationCount = source->notificationCount;
+    regs->activeChannelCount = source->activeChannelCount;
     return STATUS_SUCCESS;
 }
 
 NTSTATUS SarWriteEndpointRegisters(
     SarEndpointRegisters *regs, SarEndpoint *endpoint)
 {
-    SarEndpointProcessContext *context;
-    NTSTATUS status;
+    SarEndpointRegisters *dest;
 
-    status = SarGetOrCreateEndpointProcessContext(
-        endpoint, PsGetCurrentProcess(), &context);
+    if (!endpoint->owner->registerFile) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
 
-    if (!NT_SUCCESS(status)) {
-        return status;
+    dest = &endpoint->owner->registerFile[endpoint->index];
+    dest->positionRegister = regs->positionRegister;
+    dest->clockRegister = regs->clockRegister;
+    dest->bufferOffset = regs->bufferOffset;
+    dest->bufferSize = regs->bufferSize;
+    dest->notificationCount = regs->notificationCount;
+    dest->activeChannelCount = regs->activeChannelCount;
+    MemoryBarrier();
+    InterlockedExchange((LONG *)&dest->generation, (ULONG)regs->generation);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS SarReadClockRegisters(
+    SarClockRegisters *clock, SarEndpointRegisters *regs,
+    SarEndpoint *endpoint)
+{
+    SarClockRegisters *clockSource;
+    NTSTATUS status = STATUS_DEVICE_BUSY;
+
+    if (!endpoint->owner->registerFile) {
+        return STATUS_INVALID_DEVICE_STATE;
     }
 
-    __try {
-        SarEndpointRegisters *dest = &context->registerFileUVA[endpoint->index];
-
-        ProbeForWrite(dest,
-            sizeof(SarEndpointRegisters), TYPE_ALIGNMENT(ULONG));
-        dest->positionRegister = regs->positionRegister;
-        dest->bufferOffset = regs->bufferOffset;
-        dest->bufferSize = regs->bufferSize;
-        dest->notificationCount = regs->notificationCount;
-        dest->activeChannelCount = regs->activeChannelCount;
+    clockSource = (SarClockRegisters *)
+        ((PUCHAR)endpoint->owner->registerFile + SAR_CLOCK_REGISTER_OFFSET);
+
+    // The client only holds the sequence odd for a few stores at the end of
+    // a tick, so this normally spins briefly if at all.
+    for (int i = 0; i < SAR_CLOCK_READ_SPINS; ++i) {
+        ULONG sequence = *(volatile ULONG *)&clockSource->sequence;
+
         MemoryBarrier();
-        InterlockedExchange((LONG *)&dest->generation, (ULONG)regs->generation);
-    } __except(EXCEPTION_EXECUTE_HANDLER) {
-        return GetExceptionCode();
+
+        if (sequence & 1) {
+            YieldProcessor();
+            continue;
+        }
+
+        RtlCopyMemory(clock, clockSource, sizeof(SarClockRegisters));
+        SarReadEndpointRegisters(regs, endpoint);
+        MemoryBarrier();
+
+        if (*(volatile ULONG *)&clockSource->sequence == sequence) {
+            ExAcquireFastMutex(&endpoint->mutex);
+            endpoint->lastClock = *clock;
+            endpoint->lastClockRegisters = *regs;
+            endpoint->hasLastClock = TRUE;
+            ExReleaseFastMutex(&endpoint->mutex);
+            return STATUS_SUCCESS;
+        }
     }
 
-    return STATUS_SUCCESS;
+    // The client was preempted mid-update. Report where the clock was last
+    // seen rather than failing the query.
+    ExAcquireFastMutex(&endpoint->mutex);
+
+    if (endpoint->hasLastClock) {
+        *clock = endpoint->lastClock;
+        *regs = endpoint->lastClockRegisters;
+        status = STATUS_SUCCESS;
+    }
+
+    ExReleaseFastMutex(&endpoint->mutex);
+    return status;
 }
 #endif
 
@@ -235,9 +272,81 @@ NTSTATUS SarWriteUserBuffer(PVOID src, PIRP irp, ULONG size)
 
 void SarInitializeHandleQueue(SarHandleQueue *queue)
 {
-    KeInitializeSpinLock(&queue->lock);
-    InitializeListHead(&queue->pendingIrps);
-    InitializeListHead(&queue->pendingItems);
+    ExInitializeFastMutex(&queue->drainMutex);
+    queue->pendingIrp = nullptr;
+    queue->head = 0;
+    queue->tail = 0;
+
+    for (LONG i = 0; i < SAR_HANDLE_QUEUE_CAPACITY; ++i) {
+        queue->slots[i].sequence = i;
+    }
+}
+
+static BOOLEAN SarPushHandleQueue(
+    SarHandleQueue *queue, HANDLE kernelProcessHandle, HANDLE userHandle,
+    ULONG64 associatedData)
+{
+    SarHandleQueueSlot *slot;
+    LONG position = queue->tail;
+
+    for (;;) {
+        slot = &queue->slots[position & (SAR_HANDLE_QUEUE_CAPACITY - 1)];
+
+        LONG difference = slot->sequence - position;
+
+        if (difference == 0) {
+            LONG previous = InterlockedCompareExchange(
+                &queue->tail, position + 1, position);
+
+            if (previous == position) {
+                break;
+            }
+
+            position = previous;
+        } else if (difference < 0) {
+            // The consumer hasn't released this slot yet, so the ring is full.
+            return FALSE;
+        } else {
+            position = queue->tail;
+        }
+    }
+
+    slot->kernelProcessHandle = kernelProcessHandle;
+    slot->userHandle = userHandle;
+    slot->associatedData = associatedData;
+    InterlockedExchange(&slot->sequence, position + 1);
+    return TRUE;
+}
+
+// Must be called with the drain mutex held.
+static BOOLEAN SarPopHandleQueue(
+    SarHandleQueue *queue, HANDLE *kernelProcessHandle, HANDLE *userHandle,
+    ULONG64 *associatedData)
+{
+    LONG position = queue->head;
+    SarHandleQueueSlot *slot =
+        &queue->slots[position & (SAR_HANDLE_QUEUE_CAPACITY - 1)];
+
+    if (InterlockedCompareExchange(&slot->sequence, 0, 0) != position + 1) {
+        return FALSE;
+    }
+
+    *kernelProcessHandle = slot->kernelProcessHandle;
+    *userHandle = slot->userHandle;
+    *associatedData = slot->associatedData;
+    queue->head = position + 1;
+    InterlockedExchange(
+        &slot->sequence, position + SAR_HANDLE_QUEUE_CAPACITY);
+    return TRUE;
+}
+
+static BOOLEAN SarIsHandleQueueEmpty(SarHandleQueue *queue)
+{
+    LONG position = queue->head;
+    SarHandleQueueSlot *slot =
+        &queue->slots[position & (SAR_HANDLE_QUEUE_CAPACITY - 1)];
+
+    return InterlockedCompareExchange(&slot->sequence, 0, 0) != position + 1;
 }
 
 NTSTATUS SarTransferQueuedHandle(
@@ -270,42 +379,94 @@ NTSTATUS SarTransferQueuedHandle(
     return status;
 }
 
-void SarCancelAllHandleQueueIrps(SarHandleQueue *handleQueue)
+// Moves as many queued handles as fit into the IRP's output buffer. Returns
+// the number of responses written.
+static ULONG SarDrainHandleQueue(
+    SarHandleQueue *queue, PIRP irp, HANDLE kernelTargetProcessHandle)
 {
-    KIRQL irql;
-    LIST_ENTRY pendingIrqsToCancel;
+    PIO_STACK_LOCATION irpStack = IoGetCurrentIrpStackLocation(irp);
+    ULONG maxItems = irpStack->Parameters.DeviceIoControl.OutputBufferLength /
+        sizeof(SarHandleQueueResponse);
+    ULONG nextItem = 0;
+    HANDLE kernelProcessHandle, userHandle;
+    ULONG64 associatedData;
+
+    KeEnterCriticalRegion();
+    ExAcquireFastMutexUnsafe(&queue->drainMutex);
+
+    while (nextItem < maxItems &&
+        SarPopHandleQueue(
+            queue, &kernelProcessHandle, &userHandle, &associatedData)) {
+
+        NTSTATUS status = SarTransferQueuedHandle(
+            irp, kernelTargetProcessHandle, nextItem++,
+            kernelProcessHandle, userHandle, associatedData);
+
+        // A failed duplication (usually because the registering process
+        // already exited) is reported as a null handle so that the rest of
+        // the batch still reaches the client.
+        if (!NT_SUCCESS(status)) {
+            SAR_WARNING("Couldn't transfer queued handle: %08X", status);
+        }
 
-    InitializeListHead(&pendingIrqsToCancel);
+        ZwClose(kernelProcessHandle);
+    }
 
-    KeAcquireSpinLock(&handleQueue->lock, &irql);
+    ExReleaseFastMutexUnsafe(&queue->drainMutex);
+    KeLeaveCriticalRegion();
+    irp->IoStatus.Information = nextItem * sizeof(SarHandleQueueResponse);
+    return nextItem;
+}
 
-    if (!IsListEmpty(&handleQueue->pendingIrps)) {
-        PLIST_ENTRY entry = handleQueue->pendingIrps.Flink;
+// Completes a wait IRP that the caller took ownership of by swapping it out
+// of pendingIrp.
+static VOID SarCompleteHandleQueueIrp(SarHandleQueue *queue, PIRP irp)
+{
+    HANDLE kernelProcessHandle = irp->Tail.Overlay.DriverContext[0];
 
-        RemoveEntryList(&handleQueue->pendingIrps);
-        InitializeListHead(&handleQueue->pendingIrps);
-        AppendTailList(&pendingIrqsToCancel, entry);
+    if (IoSetCancelRoutine(irp, nullptr)) {
+        SarDrainHandleQueue(queue, irp, kernelProcessHandle);
+        irp->IoStatus.Status = STATUS_SUCCESS;
+        SAR_DEBUG("complete handle queue");
+    } else {
+        // The cancel routine is about to run but will find pendingIrp empty,
+        // so completing the IRP falls to us.
+        irp->IoStatus.Information = 0;
+        irp->IoStatus.Status = STATUS_CANCELLED;
     }
 
-    KeReleaseSpinLock(&handleQueue->lock, irql);
-
-    while (!IsListEmpty(&pendingIrqsToCancel)) {
-        SarHandleQueueIrp *pendingIrp =
-            CONTAINING_RECORD(pendingIrqsToCancel.Flink, SarHandleQueueIrp, listEntry);
-        PIRP irp = pendingIrp->irp;
-
-        RemoveEntryList(&pendingIrp->listEntry);
+    ZwClose(kernelProcessHandle);
+    IoCompleteRequest(irp, IO_NO_INCREMENT);
+}
 
-        ZwClose(pendingIrp->kernelProcessHandle);
-        ExFreePoolWithTag(pendingIrp, SAR_TAG);
+void SarCancelAllHandleQueueIrps(SarHandleQueue *handleQueue)
+{
+    PIRP irp = (PIRP)InterlockedExchangePointer(
+        (PVOID *)&handleQueue->pendingIrp, nullptr);
+    HANDLE kernelProcessHandle, userHandle;
+    ULONG64 associatedData;
 
+    if (irp) {
         SAR_INFO("Cancelling IRP %p", irp);
-
+        IoSetCancelRoutine(irp, nullptr);
+        ZwClose(irp->Tail.Overlay.DriverContext[0]);
         irp->IoStatus.Information = 0;
         irp->IoStatus.Status = STATUS_CANCELLED;
-        IoSetCancelRoutine(irp, nullptr);
         IoCompleteRequest(irp, IO_NO_INCREMENT);
     }
+
+    // Nobody is going to collect the queued handles anymore.
+    KeEnterCriticalRegion();
+    ExAcquireFastMutexUnsafe(&handleQueue->drainMutex);
+
+    while (SarPopHandleQueue(
+        handleQueue, &kernelProcessHandle, &userHandle, &associatedData)) {
+
+        ZwClose(kernelProcessHandle);
+    }
+
+    ExReleaseFastMutexUnsafe(&handleQueue->drainMutex);
+    KeLeaveCriticalRegion();
 }
 
 void SarCancelHandleQueueIrp(PDEVICE_OBJECT deviceObject, PIRP irp)
@@ -317,36 +478,19 @@ void SarCancelHandleQueueIrp(PDEVICE_OBJECT deviceObject, PIRP irp)
     SarDriverExtension *extension = SarGetDriverExtensionFromIrp(irp);
     SarControlContext *controlContext =
         SarGetControlContextFromFileObject(extension, irpStack->FileObject);
-    PLIST_ENTRY entry;
-    SarHandleQueueIrp *toCancel = nullptr;
-    KIRQL irql;
 
     if (!controlContext) {
         SAR_WARNING("Received Cancel IRP without control context");
         return;
     }
 
-    KeAcquireSpinLock(&controlContext->handleQueue.lock,  &irql);
-    entry = controlContext->handleQueue.pendingIrps.Flink;
-
-    while (entry != &controlContext->handleQueue.pendingIrps) {
-        SarHandleQueueIrp *pendingIrp =
-            CONTAINING_RECORD(entry, SarHandleQueueIrp, listEntry);
-
-        entry = entry->Flink;
-
-        if (pendingIrp->irp == irp) {
-            RemoveEntryList(&pendingIrp->listEntry);
-            toCancel = pendingIrp;
-            break;
-        }
-    }
-
-    KeReleaseSpinLock(&controlContext->handleQueue.lock, irql);
+    // Only complete the IRP if it's still parked; otherwise whoever took it
+    // out of the queue completes it.
+    if (InterlockedCompareExchangePointer(
+        (PVOID *)&controlContext->handleQueue.pendingIrp,
+        nullptr, irp) == irp) {
 
-    if (toCancel) {
-        ZwClose(toCancel->kernelProcessHandle);
-        ExFreePoolWithTag(toCancel, SAR_TAG);
+        ZwClose(irp->Tail.Overlay.DriverContext[0]);
         irp->IoStatus.Information = 0;
         irp->IoStatus.Status = STATUS_CANCELLED;
         IoCompleteRequest(irp, IO_NO_INCREMENT);
@@ -358,8 +502,6 @@ NTSTATUS SarPostHandleQueue(
 {
     NTSTATUS status = STATUS_SUCCESS;
     HANDLE kernelProcessHandle = nullptr;
-    SarHandleQueueIrp *queuedIrp = nullptr;
-    KIRQL irql;
 
     status = ObOpenObjectByPointerWithTag(
         PsGetCurrentProcess(), OBJ_KERNEL_HANDLE,
@@ -370,50 +512,25 @@ NTSTATUS SarPostHandleQueue(
         return status;
     }
 
-    KeAcquireSpinLock(&queue->lock, &irql);
-
-    if (!IsListEmpty(&queue->pendingIrps)) {
-        PLIST_ENTRY entry = queue->pendingIrps.Flink;
-
-        queuedIrp =
-            CONTAINING_RECORD(entry, SarHandleQueueIrp, listEntry);
-        RemoveEntryList(entry);
-    }
-
-    if (!queuedIrp) {
-        SarHandleQueueItem *item = (SarHandleQueueItem *)ExAllocatePoolWithTag(
-            NonPagedPool, sizeof(SarHandleQueueItem), SAR_TAG);
+    if (!SarPushHandleQueue(
+        queue, kernelProcessHandle, userHandle, associatedData)) {
 
-        if (!item) {
-            KeReleaseSpinLock(&queue->lock, irql);
-            ZwClose(kernelProcessHandle);
-            return STATUS_INSUFFICIENT_RESOURCES;
-        }
-
-        item->associatedData = associatedData;
-        item->userHandle = userHandle;
-        item->kernelProcessHandle = kernelProcessHandle;
-        InsertTailList(&queue->pendingItems, &item->listEntry);
+        SAR_ERROR("Handle queue is full");
+        ZwClose(kernelProcessHandle);
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    KeReleaseSpinLock(&queue->lock, irql);
-
-    if (queuedIrp) {
-        status = SarTransferQueuedHandle(
-            queuedIrp->irp, queuedIrp->kernelProcessHandle,
-            0, kernelProcessHandle, userHandle, associatedData);
+    // The interlocked publish above orders the push before this read. The
+    // waiter parks its IRP before re-checking the ring, so at least one of
+    // us sees the other's update.
+    PIRP irp = (PIRP)InterlockedExchangePointer(
+        (PVOID *)&queue->pendingIrp, nullptr);
 
-        SAR_DEBUG("complete handle queue");
-
-        queuedIrp->irp->IoStatus.Status = status;
-        queuedIrp->irp->IoStatus.Information = sizeof(SarHandleQueueResponse);
-        IoSetCancelRoutine(queuedIrp->irp, nullptr);
-        IoCompleteRequest(queuedIrp->irp, IO_NO_INCREMENT);
-        ZwClose(kernelProcessHandle);
-        ExFreePoolWithTag(queuedIrp, SAR_TAG);
+    if (irp) {
+        SarCompleteHandleQueueIrp(queue, irp);
     }
 
-    return status;
+    return STATUS_SUCCESS;
 }
 
 NTSTATUS SarWaitHandleQueue(SarHandleQueue *queue, PIRP irp)
@@ -423,17 +540,11 @@ NTSTATUS SarWaitHandleQueue(SarHandleQueue *queue, PIRP irp)
     PIO_STACK_LOCATION irpStack = IoGetCurrentIrpStackLocation(irp);
     DWORD maxItems = irpStack->Parameters.DeviceIoControl.OutputBufferLength /
         sizeof(SarHandleQueueResponse);
-    DWORD nextItem = 0;
-    LIST_ENTRY toComplete;
-    KIRQL irql;
 
-    InitializeListHead(&toComplete);
     irp->IoStatus.Information = 0;
 
     if (maxItems == 0) {
         irp->IoStatus.Information = sizeof(SarHandleQueueResponse);
-        irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
-        IoCompleteRequest(irp, IO_NO_INCREMENT);
         return STATUS_BUFFER_TOO_SMALL;
     }
 
@@ -446,61 +557,38 @@ NTSTATUS SarWaitHandleQueue(SarHandleQueue *queue, PIRP irp)
         return status;
     }
 
-    KeAcquireSpinLock(&queue->lock, &irql);
-
-    while (!IsListEmpty(&queue->pendingItems) && nextItem < maxItems) {
-        PLIST_ENTRY entry = RemoveHeadList(&queue->pendingItems);
-
-        InsertTailList(&toComplete, entry);
-        nextItem++;
+    if (SarDrainHandleQueue(queue, irp, kernelProcessHandle)) {
+        ZwClose(kernelProcessHandle);
+        return STATUS_SUCCESS;
     }
 
-    if (IsListEmpty(&toComplete)) {
-        SarHandleQueueIrp *queuedIrp = (SarHandleQueueIrp *)
-            ExAllocatePoolWithTag(
-                NonPagedPool, sizeof(SarHandleQueueIrp), SAR_TAG);
+    // Nothing queued, park the IRP until the next post.
+    irp->Tail.Overlay.DriverContext[0] = kernelProcessHandle;
+    IoMarkIrpPending(irp);
+    IoSetCancelRoutine(irp, SarCancelHandleQueueIrp);
 
-        if (!queuedIrp) {
-            KeReleaseSpinLock(&queue->lock, irql);
-            ZwClose(kernelProcessHandle);
-            return STATUS_INSUFFICIENT_RESOURCES;
-        }
+    if (InterlockedCompareExchangePointer(
+        (PVOID *)&queue->pendingIrp, irp, nullptr) != nullptr) {
 
-        IoMarkIrpPending(irp);
-        IoSetCancelRoutine(irp, SarCancelHandleQueueIrp);
-        queuedIrp->irp = irp;
-        queuedIrp->kernelProcessHandle = kernelProcessHandle;
-        InsertTailList(&queue->pendingIrps, &queuedIrp->listEntry);
-        status = STATUS_PENDING;
+        // The client only ever keeps one wait outstanding.
+        SAR_ERROR("Handle queue already has a pending wait");
+        IoSetCancelRoutine(irp, nullptr);
+        ZwClose(kernelProcessHandle);
+        irp->IoStatus.Status = STATUS_DEVICE_BUSY;
+        IoCompleteRequest(irp, IO_NO_INCREMENT);
+        return STATUS_PENDING;
     }
 
-    KeReleaseSpinLock(&queue->lock, irql);
-
-    if (!IsListEmpty(&toComplete)) {
-        nextItem = 0;
-
-        while (!IsListEmpty(&toComplete)) {
-            PLIST_ENTRY entry = RemoveHeadList(&toComplete);
-            SarHandleQueueItem *queueItem =
-                CONTAINING_RECORD(entry, SarHandleQueueItem, listEntry);
-
-            status = SarTransferQueuedHandle(
-                irp, kernelProcessHandle, nextItem++,
-                queueItem->kernelProcessHandle, queueItem->userHandle,
-                queueItem->associatedData);
-            ZwClose(queueItem->kernelProcessHandle);
-            ExFreePoolWithTag(queueItem, SAR_TAG);
-            irp->IoStatus.Information += sizeof(SarHandleQueueResponse);
-
-            if (!NT_SUCCESS(status)) {
-                break;
-            }
-        }
+    // Pick the IRP back up if it was cancelled before it was parked or if a
+    // post raced with us, unless someone else already did.
+    if ((irp->Cancel || !SarIsHandleQueueEmpty(queue)) &&
+        InterlockedCompareExchangePointer(
+            (PVOID *)&queue->pendingIrp, nullptr, irp) == irp) {
 
-        ZwClose(kernelProcessHandle);
+        SarCompleteHandleQueueIrp(queue, irp);
     }
 
-    return status;
+    return STATUS_PENDING;
 }
 
 RTL_GENERIC_COMPARE_RESULTS NTAPI SarCompareTableEntry(
@@ -684,6 +772,76 @@ VOID SarClearStringTable(PRTL_AVL_TABLE table, VOID (*freeCb)(PVOID))
     NT_ASSERT(RtlIsGenericTableEmptyAvl(table));
 }
 
+static ULONG64 SarRegistryPrefilterBloomMask(ULONG hash)
+{
+    return (1ull << (hash & 63)) | (1ull << ((hash >> 6) & 63));
+}
+
+NTSTATUS SarAddRegistryPrefilterEntry(
+    SarRegistryPrefilter *prefilter, PCUNICODE_STRING key)
+{
+    NTSTATUS status;
+    ULONG hash;
+
+    if (prefilter->count >= SAR_MAX_REGISTRY_REDIRECTS) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    status = RtlHashUnicodeString(
+        key, TRUE, HASH_STRING_ALGORITHM_X65599, &hash);
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    prefilter->lengths[prefilter->count] = key->Length;
+    prefilter->hashes[prefilter->count] = hash;
+    prefilter->bloom |= SarRegistryPrefilterBloomMask(hash);
+    prefilter->count++;
+    return STATUS_SUCCESS;
+}
+
+BOOLEAN SarRegistryPrefilterMayMatch(
+    SarRegistryPrefilter *prefilter, PCUNICODE_STRING key)
+{
+    ULONG hash;
+    ULONG i;
+
+    for (i = 0; i < prefilter->count; ++i) {
+        if (prefilter->lengths[i] == key->Length) {
+            break;
+        }
+    }
+
+    if (i == prefilter->count) {
+        return FALSE;
+    }
+
+    // Hashing upcases the key without allocating, so this is safe to run on
+    // the paged path the configuration manager hands us.
+    if (!NT_SUCCESS(RtlHashUnicodeString(
+        key, TRUE, HASH_STRING_ALGORITHM_X65599, &hash))) {
+
+        return TRUE;
+    }
+
+    if ((prefilter->bloom & SarRegistryPrefilterBloomMask(hash)) !=
+        SarRegistryPrefilterBloomMask(hash)) {
+
+        return FALSE;
+    }
+
+    for (i = 0; i < prefilter->count; ++i) {
+        if (prefilter->hashes[i] == hash &&
+            prefilter->lengths[i] == key->Length) {
+
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
 NTSTATUS SarCopyProcessUser(PEPROCESS process, PTOKEN_USER *outTokenUser)
 {
     NT_ASSERT(process);
@@ -54,7 +54,7 @@ NTSTATUS SarKsPinRtGetBufferCore(
     ULONG actualSize = ROUND_UP(
         max(requestedBufferSize,
             controlContext->minimumFrameCount *
-            controlContext->periodSizeBytes *
+            endpoint->periodSizeBytes *
             endpoint->activeChannelCount),
         controlContext->sampleSize * endpoint->activeChannelCount);
     SIZE_T viewSize = ROUND_UP(actualSize, SAR_BUFFER_CELL_SIZE);
@@ -156,13 +156,37 @@ NTSTATUS SarKsPinRtGetBufferWithNotification(
 NTSTATUS SarKsPinRtGetClockRegister(
     PIRP irp, PKSIDENTIFIER request, PVOID data)
 {
-    UNREFERENCED_PARAMETER(irp);
     UNREFERENCED_PARAMETER(request);
-    UNREFERENCED_PARAMETER(data);
 
-    // The clock register should be a continuously updated register at a fixed frequency.
-    // We don't have anything like this to map as a register, report it as not implemented.
-    return STATUS_NOT_IMPLEMENTED;
+    NTSTATUS status;
+    PKSRTAUDIO_HWREGISTER reg = (PKSRTAUDIO_HWREGISTER)data;
+    SarEndpoint *endpoint = SarGetEndpointFromIrp(irp, TRUE);
+    SarEndpointProcessContext *context;
+
+    if (!endpoint) {
+        SAR_ERROR("Get endpoint failed");
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    status = SarGetOrCreateEndpointProcessContext(
+        endpoint, PsGetCurrentProcess(), &context);
+
+    if (!NT_SUCCESS(status)) {
+        SarReleaseEndpointAndContext(endpoint);
+        return status;
+    }
+
+    // The clock register counts ASIO ticks processed by the endpoint, so it
+    // runs at sampleRate / periodFrames Hz.
+    reg->Register =
+        &context->registerFileUVA[endpoint->index].clockRegister;
+    reg->Width = 32;
+    reg->Accuracy = 1;
+    reg->Numerator = endpoint->owner->sampleRate;
+    reg->Denominator =
+        endpoint->owner->periodSizeBytes / endpoint->owner->sampleSize;
+    SarReleaseEndpointAndContext(endpoint);
+    return STATUS_SUCCESS;
 }
 
 NTSTATUS SarKsPinRtGetHwLatency(
@@ -218,7 +242,7 @@ NTSTATUS SarKsPinRtGetPositionRegister(
     reg->Register =
         &context->registerFileUVA[endpoint->index].positionRegister;
     reg->Width = 32;
-    reg->Accuracy = endpoint->owner->periodSizeBytes * endpoint->activeChannelCount;
+    reg->Accuracy = endpoint->periodSizeBytes * endpoint->activeChannelCount;
     reg->Numerator = 0;
     reg->Denominator = 0;
     SarReleaseEndpointAndContext(endpoint);
@@ -228,10 +252,49 @@ NTSTATUS SarKsPinRtGetPositionRegister(
 NTSTATUS SarKsPinRtGetPresentationPosition(
     PIRP irp, PKSIDENTIFIER request, PVOID data)
 {
-    UNREFERENCED_PARAMETER(irp);
     UNREFERENCED_PARAMETER(request);
-    UNREFERENCED_PARAMETER(data);
-    return STATUS_NOT_IMPLEMENTED;
+
+    NTSTATUS status;
+    PKSAUDIO_PRESENTATION_POSITION position =
+        (PKSAUDIO_PRESENTATION_POSITION)data;
+    SarEndpoint *endpoint = SarGetEndpointFromIrp(irp, TRUE);
+    SarClockRegisters clock = {};
+    SarEndpointRegisters regs = {};
+    ULONG64 frames;
+    DWORD streamRate, asioRate;
+
+    if (!endpoint) {
+        SAR_ERROR("Get endpoint failed");
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    status = SarReadClockRegisters(&clock, &regs, endpoint);
+
+    if (!NT_SUCCESS(status)) {
+        SAR_ERROR("Read clock registers failed %08X", status);
+        SarReleaseEndpointAndContext(endpoint);
+        return status;
+    }
+
+    // Report the position as of the smoothed time of the last tick rather
+    // than the raw tick time, which carries the ASIO driver's jitter. Ticks
+    // are counted in ASIO frames, so endpoints running at their own rate
+    // scale the position to stream frames.
+    frames = (ULONG64)regs.clockRegister * clock.periodFrames;
+    streamRate = endpoint->sampleRate;
+    asioRate = endpoint->owner->sampleRate;
+
+    if (streamRate != asioRate && asioRate) {
+        frames = frames / asioRate * streamRate +
+            frames % asioRate * streamRate / asioRate;
+    }
+
+    position->u64PositionInBlock = frames;
+    position->u64QPCPosition = clock.tickCount ?
+        (ULONG64)clock.tickTime :
+        (ULONG64)KeQueryPerformanceCounter(nullptr).QuadPart;
+    SarReleaseEndpointAndContext(endpoint);
+    return STATUS_SUCCESS;
 }
 
 NTSTATUS SarKsPinRtQueryNotificationSupport(